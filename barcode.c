@@ -1,6 +1,33 @@
 #include <assert.h>
 #include "barcode.h"
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Barcodes gathered for one call of Barcode_batchKernel */
+#define BARCODE_BATCH_LEN 64
+
+/* Largest number of hinted pixels inverted at once by 
+ * Barcode_validateWithHints: valid barcodes differ by at least 4 pixels, so
+ * farther ones could be closer to another valid barcode than to the right
+ * one */
+#define BARCODE_MAX_FLIPS 3
+
+/* Compile the batch kernel once per instruction set, the best one being 
+ * selected by the loader at run time. SSE2 is the x86-64 baseline. GCC only
+ * vectorizes at -O2 since version 12, so it is asked to explicitly. */
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__gnu_linux__)
+#if defined(__clang__)
+#define BARCODE_BATCH_TARGETS \
+  __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define BARCODE_BATCH_TARGETS \
+  __attribute__((target_clones("avx512f", "avx2", "default"), \
+                 optimize("tree-vectorize")))
+#endif
+#else
+#define BARCODE_BATCH_TARGETS
+#endif
 
 /* PRIVATE HEADER */
 
@@ -47,6 +74,44 @@ static inline void Barcode_renderChecksum(PBM *barcode);
  */
 static int Barcode_mkCheckBit(unsigned char col, unsigned char row);
 
+/*
+ * Barcodes of a batch, one lane per barcode. Data rows are stored in bytes,
+ * lo holding rows 0 to 3 and hi rows 4 to 7 (row 0 in the lowest byte, 
+ * column 0 in the lowest bit); col, row and bit hold checksums read in the
+ * image, as in Barcode_readChecksum. size is the data size (width-1).
+ */
+typedef struct {
+  uint32_t lo[BARCODE_BATCH_LEN], hi[BARCODE_BATCH_LEN];
+  uint32_t col[BARCODE_BATCH_LEN], row[BARCODE_BATCH_LEN];
+  uint32_t bit[BARCODE_BATCH_LEN], size[BARCODE_BATCH_LEN];
+  int32_t  result[BARCODE_BATCH_LEN];         /* as validateChecksum */
+  uint32_t fix_x[BARCODE_BATCH_LEN], fix_y[BARCODE_BATCH_LEN]; /* if 1 */
+} Barcode_Batch;
+
+/*
+ * Load a barcode in lane i of batch
+ * @pre : barcode is a valid Barcode, i<BARCODE_BATCH_LEN
+ */
+static void Barcode_gather(Barcode_Batch *batch, size_t i, PBM *barcode);
+
+/*
+ * @pre : x<256
+ * @post: returns the number of bits set in x
+ */
+static inline uint32_t Barcode_popcount8(uint32_t x);
+
+/*
+ * Same computation as Barcode_validateChecksum on each lane of batch,
+ * except that corrections are only stored in fix_x and fix_y.
+ * Lanes are independent and only use shifts, masks, additions and 
+ * comparisons, so that the compiler could process one lane per 32-bit 
+ * element of vector registers (4 with SSE2, 8 with AVX2, 16 with AVX-512).
+ * All lanes are processed, to get a fixed trip count.
+ * @pre : batch is a valid pointer, unused lanes are zeroed
+ * @post: result, fix_x and fix_y filled for each lane
+ */
+static void Barcode_batchKernel(Barcode_Batch *batch);
+
 
 /* PRIVATE IMPLEMENTATION */
 
@@ -137,6 +202,110 @@ static inline void Barcode_renderChecksum(PBM *barcode){
   Barcode_drawChecksum(barcode, col, row, bit);
 }
 
+static void Barcode_gather(Barcode_Batch *batch, size_t i, PBM *barcode){
+  size_t width, height, size, y;
+  unsigned long long line;
+  assert(batch);
+  assert(i<BARCODE_BATCH_LEN);
+  assert(barcode);
+  PBM_size(barcode, &width, &height);
+  assert(width == height);
+  assert(2<=width && width<=9);
+  
+  size = width-1;
+  batch->lo[i] = batch->hi[i] = batch->col[i] = 0;
+  for (y=0; y<size; y++){
+    line = PBM_getBits(barcode, 0, y, width);
+    if (y<4) batch->lo[i] |= (uint32_t) (line & ~(1ULL<<size)) << (8*y);
+    else     batch->hi[i] |= (uint32_t) (line & ~(1ULL<<size)) << (8*(y-4));
+    batch->col[i] |= (uint32_t) ((line>>size) & 0x01) << y;
+  }
+  line = PBM_getBits(barcode, 0, size, width);
+  batch->row[i]  = (uint32_t) (line & ~(1ULL<<size));
+  batch->bit[i]  = (uint32_t) ((line>>size) & 0x01);
+  batch->size[i] = (uint32_t) size;
+}
+
+static inline uint32_t Barcode_popcount8(uint32_t x){
+  x = x - ((x>>1) & 0x55);
+  x = (x & 0x33) + ((x>>2) & 0x33);
+  return (x + (x>>4)) & 0x0f;
+}
+
+BARCODE_BATCH_TARGETS
+static void Barcode_batchKernel(Barcode_Batch *batch){
+  size_t i;
+  uint32_t lo, hi, par_lo, par_hi, col, row, col_err, row_err;
+  uint32_t col_count, row_count, col_err_count, row_err_count;
+  uint32_t smear_col, smear_row, wrong_x, wrong_y, size;
+  uint32_t bit, bit_img_ok, one_col, one_row, no_col, no_row;
+  int32_t  res;
+  assert(batch);
+  
+  for (i=0; i<BARCODE_BATCH_LEN; i++){
+    lo = batch->lo[i];
+    hi = batch->hi[i];
+    size = batch->size[i];
+    
+    /* parity of each column: xor of all data rows */
+    row = lo ^ hi;
+    row ^= row >> 16;
+    row ^= row >> 8;
+    row &= 0xff;
+    
+    /* parity of each data row, one bit per byte, then packed */
+    par_lo = lo ^ (lo >> 4);
+    par_lo ^= par_lo >> 2;
+    par_lo ^= par_lo >> 1;
+    par_lo &= 0x01010101;
+    par_hi = hi ^ (hi >> 4);
+    par_hi ^= par_hi >> 2;
+    par_hi ^= par_hi >> 1;
+    par_hi &= 0x01010101;
+    col = ((par_lo | (par_lo>>7) | (par_lo>>14) | (par_lo>>21)) & 0x0f) |
+          (((par_hi | (par_hi>>7) | (par_hi>>14) | (par_hi>>21)) & 0x0f) << 4);
+    
+    /* checksum bit, as Barcode_mkCheckBit converted to bool */
+    col_count = Barcode_popcount8(col);
+    row_count = Barcode_popcount8(row);
+    bit = (col_count != row_count) ? 1 : (col_count & 0x01);
+    
+    /* same for the checksum lines drawn in image: Barcode_mkCheckBit would 
+     * return bit[i] if they have the same number of bits set */
+    col_count = Barcode_popcount8(batch->col[i]);
+    row_count = Barcode_popcount8(batch->row[i]);
+    bit_img_ok = (col_count == row_count) ? 
+                 ~((col_count & 0x01) ^ batch->bit[i]) & 0x01 : 0;
+    
+    /* errors, and position of the last one in each checksum line */
+    col_err = batch->col[i] ^ col;
+    row_err = batch->row[i] ^ row;
+    col_err_count = Barcode_popcount8(col_err);
+    row_err_count = Barcode_popcount8(row_err);
+    smear_col = col_err | (col_err>>1);
+    smear_col |= smear_col >> 2;
+    smear_col |= smear_col >> 4;
+    smear_row = row_err | (row_err>>1);
+    smear_row |= smear_row >> 2;
+    smear_row |= smear_row >> 4;
+    wrong_y = Barcode_popcount8(smear_col) - 1;
+    wrong_x = Barcode_popcount8(smear_row) - 1;
+    
+    /* same scenarios as Barcode_validateChecksum, as 0/1 flags rather
+     * than booleans, which the vectorizer doesn't handle */
+    one_col = (col_err_count == 1) ? 1 : 0;
+    one_row = (row_err_count == 1) ? 1 : 0;
+    no_col  = (col_err_count == 0) ? 1 : 0;
+    no_row  = (row_err_count == 0) ? 1 : 0;
+    res = ((one_col | no_col) & (one_row | no_row) & 
+           (bit_img_ok ^ (one_col & one_row) ^ 0x01)) ? 1 : -1;
+    res = (no_col & no_row & (batch->bit[i] ^ bit ^ 0x01)) ? 0 : res;
+    batch->result[i] = res;
+    batch->fix_x[i]  = (one_row) ? wrong_x : size;
+    batch->fix_y[i]  = (one_col) ? wrong_y : size;
+  }
+}
+
 /* PUBLIC IMPLEMENTATION */
 
 PBM *Barcode_renderULL(unsigned long long value, size_t size){
@@ -233,3 +402,79 @@ int Barcode_validateChecksum(PBM *barcode){
   
   return -1;
 }
+
+int Barcode_validateWithHints(PBM *barcode, PBM *hints){
+  PBM_Inline work_storage, found_storage;
+  PBM *work, *found;
+  size_t width, height, x, y, i, hints_len = 0, valid_len = 0;
+  size_t hint_x[BARCODE_MAX_HINTS], hint_y[BARCODE_MAX_HINTS];
+  unsigned long combo, rest;
+  unsigned int weight, combo_weight;
+  int res;
+  assert(barcode);
+  
+  /* a single error is always found without hints, and is the closest
+   * valid barcode */
+  res = Barcode_validateChecksum(barcode);
+  if (res != -1) return res;
+  
+  PBM_size(barcode, &width, &height);
+  for (y=0; hints && y<height && hints_len<=BARCODE_MAX_HINTS; y++){
+    for (x=0; x<width && hints_len<=BARCODE_MAX_HINTS; x++){
+      if (! PBM_get(hints, x, y)) continue;
+      if (hints_len < BARCODE_MAX_HINTS){
+        hint_x[hints_len] = x;
+        hint_y[hints_len] = y;
+      }
+      hints_len++;
+    }
+  }
+  if (hints_len == 0 || hints_len > BARCODE_MAX_HINTS) return -1;
+  
+  /* barcodes are small enough to be checked without any allocation */
+  work  = PBM_initInline(&work_storage, width, height);
+  found = PBM_initInline(&found_storage, width, height);
+  assert(work && found);
+  
+  /* closest valid barcodes first, which must be unique at their distance */
+  for (weight=2; weight<=BARCODE_MAX_FLIPS && valid_len==0; weight++){
+    for (combo=1; combo < (1UL << hints_len) && valid_len<2; combo++){
+      for (combo_weight=0, rest=combo; rest; rest &= rest-1) combo_weight++;
+      if (combo_weight != weight) continue;
+      PBM_blit(work, 0, 0, barcode, 1);
+      for (i=0; i<hints_len; i++)
+        if ((combo >> i) & 1) PBM_invert(work, hint_x[i], hint_y[i]);
+      if (Barcode_validateChecksum(work) != 0) continue;
+      if (valid_len++ == 0) PBM_blit(found, 0, 0, work, 1);
+    }
+  }
+  
+  if (valid_len != 1) return -1;
+  PBM_blit(barcode, 0, 0, found, 1);
+  return 1;
+}
+
+void Barcode_validateBatch(PBM **images, size_t n, int *results){
+  Barcode_Batch batch;
+  size_t done, len, i;
+  
+  memset(&batch, 0, sizeof(batch));
+  assert(images || n == 0);
+  assert(results || n == 0);
+  
+  for (done=0; done<n; done+=len){
+    len = n-done;
+    if (len > BARCODE_BATCH_LEN) len = BARCODE_BATCH_LEN;
+    
+    for (i=0; i<len; i++)
+      Barcode_gather(&batch, i, images[done+i]);
+    for (; i<BARCODE_BATCH_LEN; i++)
+      batch.lo[i] = batch.hi[i] = batch.col[i] = batch.row[i] = 0;
+    Barcode_batchKernel(&batch);
+    for (i=0; i<len; i++){
+      results[done+i] = batch.result[i];
+      if (batch.result[i] == 1)
+        PBM_invert(images[done+i], batch.fix_x[i], batch.fix_y[i]);
+    }
+  }
+}
@@ -15,6 +15,9 @@
 #include <stdbool.h>
 #include "pbm.h"
 
+/* Largest number of hints tried by Barcode_validateWithHints */
+#define BARCODE_MAX_HINTS 10
+
 /*
  * @pre : size>0, size<8, value<(2**(size*size))
  * @post: returns a PBM image representing the barcode, 
@@ -32,4 +35,29 @@ PBM *Barcode_renderULL(unsigned long long value, size_t size);
  */
 int Barcode_validateChecksum(PBM *barcode);
 
+/*
+ * Same as Barcode_validateChecksum, helped by hints: pixels which could be
+ * wrong, such as the non-uniform modules reported by PBM_readP1Vote. If
+ * Barcode_validateChecksum can't rectify barcode, inversions of 2, then 3
+ * hinted pixels are tried (for at most BARCODE_MAX_HINTS hints); the barcode
+ * is only corrected if exactly one of the fewest inversions gives a valid
+ * barcode.
+ * @pre : barcode is a valid barcode, hints is NULL or an image of the same
+ *        size
+ * @post: same as Barcode_validateChecksum, 1 being returned when corrected
+ *        with hints
+ */
+int Barcode_validateWithHints(PBM *barcode, PBM *hints);
+
+/*
+ * Same as Barcode_validateChecksum on n barcodes at once. Barcodes are 
+ * checked several at a time with the widest vector instructions of the CPU
+ * (chosen at run time), so prefer this one to check large sets of barcodes.
+ * @pre : images contains n valid barcodes (possibly of different sizes), 
+ *        results has room for n values
+ * @post: results[i] is Barcode_validateChecksum(images[i]), and images
+ *        are corrected the same way
+ */
+void Barcode_validateBatch(PBM **images, size_t n, int *results);
+
 #endif
@@ -0,0 +1,372 @@
+#define _POSIX_C_SOURCE 200809L
+#include "check_cache.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* PRIVATE HEADER */
+
+/* Written at the start of cache files, to be changed with their layout */
+static const char CheckCache_magic[8] = "CHKBAR1";
+
+/* Initial number of slots, always a power of 2 */
+static const uint64_t CheckCache_minCapacity = 1024;
+
+/* Largest number of slots whose file size fits in a size_t */
+#define CHECKCACHE_MAX_CAPACITY \
+  ((SIZE_MAX - sizeof(CheckCache_Header)) / sizeof(CheckCache_Entry))
+
+/* Seconds a file must be left unchanged before its verdict is stored */
+static const time_t CheckCache_settleTime = 2;
+
+typedef struct {
+  char     magic[8];
+  uint64_t capacity;  /* number of slots */
+  uint64_t count;     /* used slots */
+} CheckCache_Header;
+
+/* A slot of the hash table, empty if sum is 0 */
+typedef struct {
+  uint64_t dev, ino, size;
+  int64_t  mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+  int32_t  verdict;
+  uint32_t sum;       /* checksum of other fields, detects torn writes */
+} CheckCache_Entry;
+
+struct CheckCache_t {
+  char *path;
+  int   fd;
+  size_t map_len;
+  CheckCache_Header *header;  /* the mapped file */
+  CheckCache_Entry  *entries; /* right after the header */
+};
+
+/*
+ * @pre : capacity<=CHECKCACHE_MAX_CAPACITY
+ * @post: returns the size of a cache file with capacity slots
+ */
+static inline size_t CheckCache_fileLen(uint64_t capacity);
+
+/*
+ * Map the file of self in memory. If init is true, the file is (re)sized
+ * for capacity slots and emptied, otherwise it is checked to be a cache file.
+ * @pre : self.fd is opened in read-write mode, capacity is a power of 2
+ * @post: returns true if self.header and self.entries could be mapped,
+ *        false if capacity is too large for the address space
+ */
+static bool CheckCache_map(CheckCache *self, uint64_t capacity, bool init);
+
+/*
+ * @pre : entry is a valid pointer
+ * @post: returns the checksum of all fields of entry except sum (never 0)
+ */
+static uint32_t CheckCache_sum(const CheckCache_Entry *entry);
+
+/*
+ * @pre : entries has capacity slots, capacity is a power of 2
+ * @post: returns the slot of (dev,ino), or the empty slot it would go in,
+ *        or NULL if the table is full
+ */
+static CheckCache_Entry *CheckCache_slot(CheckCache_Entry *entries,
+                                         uint64_t capacity,
+                                         uint64_t dev, uint64_t ino);
+
+/*
+ * Double the capacity of self, rewriting the table in a new file which then
+ * replaces the previous one.
+ * @pre : self is a valid cache
+ * @post: returns false if an error occured, self is left unchanged then
+ */
+static bool CheckCache_grow(CheckCache *self);
+
+/*
+ * @pre : fd is an opened file
+ * @post: returns true if an exclusive lock could be put on the whole file
+ */
+static bool CheckCache_lock(int fd);
+
+
+/* PRIVATE IMPLEMENTATION */
+
+static inline size_t CheckCache_fileLen(uint64_t capacity){
+  assert(capacity <= CHECKCACHE_MAX_CAPACITY);
+  return sizeof(CheckCache_Header) + capacity*sizeof(CheckCache_Entry);
+}
+
+static bool CheckCache_map(CheckCache *self, uint64_t capacity, bool init){
+  struct stat info;
+  void *map;
+  assert(self);
+  
+  if (capacity > CHECKCACHE_MAX_CAPACITY) return false;
+  if (init){
+    if (ftruncate(self->fd, 0) != 0) return false;
+    if (ftruncate(self->fd, (off_t) CheckCache_fileLen(capacity)) != 0)
+      return false;
+  } else {
+    /* the whole table must be in the file before it is mapped */
+    if (fstat(self->fd, &info) != 0 || info.st_size < 0 ||
+        (uint64_t) info.st_size != CheckCache_fileLen(capacity))
+      return false;
+  }
+  
+  map = mmap(NULL, CheckCache_fileLen(capacity), PROT_READ | PROT_WRITE,
+             MAP_SHARED, self->fd, 0);
+  if (map == MAP_FAILED) return false;
+  self->header  = map;
+  self->entries = (CheckCache_Entry *) (self->header+1);
+  self->map_len = CheckCache_fileLen(capacity);
+  
+  if (init){
+    memcpy(self->header->magic, CheckCache_magic, sizeof(CheckCache_magic));
+    self->header->capacity = capacity;
+    self->header->count    = 0;
+    return true;
+  }
+  
+  /* existing file: its header must describe its actual size */
+  if (memcmp(self->header->magic, CheckCache_magic,
+             sizeof(CheckCache_magic)) == 0 &&
+      self->header->capacity == capacity &&
+      self->header->count < capacity)
+    return true;
+  
+  munmap(map, self->map_len);
+  self->header  = NULL;
+  self->entries = NULL;
+  return false;
+}
+
+static uint32_t CheckCache_sum(const CheckCache_Entry *entry){
+  const unsigned char *bytes = (const unsigned char *) entry;
+  uint32_t res = 2166136261u;  /* FNV-1a */
+  size_t i;
+  assert(entry);
+  
+  for (i=0; i<offsetof(CheckCache_Entry, sum); i++){
+    res ^= bytes[i];
+    res *= 16777619u;
+  }
+  return (res) ? res : 1;
+}
+
+static CheckCache_Entry *CheckCache_slot(CheckCache_Entry *entries,
+                                         uint64_t capacity,
+                                         uint64_t dev, uint64_t ino)
+{
+  uint64_t hash, i, probes;
+  assert(entries);
+  
+  /* splitmix64 finalizer */
+  hash = dev*0x9e3779b97f4a7c15ULL ^ ino;
+  hash = (hash ^ (hash>>30)) * 0xbf58476d1ce4e5b9ULL;
+  hash = (hash ^ (hash>>27)) * 0x94d049bb133111ebULL;
+  hash ^= hash>>31;
+  
+  /* linear probing */
+  i = hash & (capacity-1);
+  for (probes=0; probes<capacity; probes++){
+    if (entries[i].sum == 0) return &(entries[i]);
+    if (entries[i].dev == dev && entries[i].ino == ino) return &(entries[i]);
+    i = (i+1) & (capacity-1);
+  }
+  return NULL;
+}
+
+static bool CheckCache_lock(int fd){
+  struct flock lock;
+  
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type   = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start  = 0;
+  lock.l_len    = 0;
+  return fcntl(fd, F_SETLK, &lock) == 0;
+}
+
+static bool CheckCache_grow(CheckCache *self){
+  CheckCache grown;
+  CheckCache_Entry *slot;
+  char *tmp_path;
+  uint64_t i;
+  assert(self);
+  
+  tmp_path = malloc(strlen(self->path)+5);
+  if (! tmp_path) return false;
+  sprintf(tmp_path, "%s.tmp", self->path);
+  
+  grown.path = self->path;
+  grown.fd   = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (grown.fd < 0){
+    free(tmp_path);
+    return false;
+  }
+  if (! CheckCache_lock(grown.fd) ||
+      ! CheckCache_map(&grown, 2*self->header->capacity, true)){
+    close(grown.fd);
+    unlink(tmp_path);
+    free(tmp_path);
+    return false;
+  }
+  
+  for (i=0; i<self->header->capacity; i++){
+    if (self->entries[i].sum == 0) continue;
+    slot = CheckCache_slot(grown.entries, grown.header->capacity,
+                           self->entries[i].dev, self->entries[i].ino);
+    if (slot->sum == 0) grown.header->count++;
+    *slot = self->entries[i];
+  }
+  
+  if (rename(tmp_path, self->path) != 0){
+    munmap(grown.header, grown.map_len);
+    close(grown.fd);
+    unlink(tmp_path);
+    free(tmp_path);
+    return false;
+  }
+  free(tmp_path);
+  
+  munmap(self->header, self->map_len);
+  close(self->fd);
+  self->fd      = grown.fd;
+  self->header  = grown.header;
+  self->entries = grown.entries;
+  self->map_len = grown.map_len;
+  return true;
+}
+
+
+/* PUBLIC IMPLEMENTATION */
+
+CheckCache *CheckCache_open(const char *path){
+  CheckCache *res;
+  struct stat info;
+  CheckCache_Header header;
+  assert(path && strlen(path) > 0);
+  
+  res = malloc(sizeof(CheckCache));
+  if (! res) return NULL;
+  res->path = malloc(strlen(path)+1);
+  if (! res->path){
+    free(res);
+    return NULL;
+  }
+  strcpy(res->path, path);
+  
+  res->fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (res->fd >= 0 && CheckCache_lock(res->fd) && 
+      fstat(res->fd, &info) == 0){
+    /* reuse existing file if it is a valid cache. A damaged cache is 
+     * started again, but any other file is left alone. */
+    memset(&header, 0, sizeof(header));
+    if (info.st_size == 0 ||
+        (pread(res->fd, &header, sizeof(header), 0) >= 
+           (ssize_t) sizeof(CheckCache_magic) &&
+         memcmp(header.magic, CheckCache_magic, 
+                sizeof(CheckCache_magic)) == 0)){
+      if ((size_t) info.st_size >= sizeof(header) &&
+          header.capacity >= CheckCache_minCapacity &&
+          (header.capacity & (header.capacity-1)) == 0 &&
+          CheckCache_map(res, header.capacity, false))
+        return res;
+      if (CheckCache_map(res, CheckCache_minCapacity, true))
+        return res;
+    }
+  }
+  
+  if (res->fd >= 0) close(res->fd);
+  free(res->path);
+  free(res);
+  return NULL;
+}
+
+char *CheckCache_defaultPath(void){
+  const char *dir = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+  char *res;
+  
+  if (dir && *dir){
+    res = malloc(strlen(dir)+16);
+    if (res) sprintf(res, "%s/checkbar.cache", dir);
+  } else if (home && *home){
+    res = malloc(strlen(home)+23);
+    if (! res) return NULL;
+    sprintf(res, "%s/.cache", home);
+    mkdir(res, 0700);
+    strcat(res, "/checkbar.cache");
+  } else {
+    res = NULL;
+  }
+  return res;
+}
+
+bool CheckCache_lookup(CheckCache *self, const struct stat *file,
+                       int *verdict)
+{
+  CheckCache_Entry *slot, expected;
+  assert(self && file && verdict);
+  
+  slot = CheckCache_slot(self->entries, self->header->capacity,
+                         (uint64_t) file->st_dev, (uint64_t) file->st_ino);
+  if (! slot || slot->sum == 0) return false;
+  
+  memset(&expected, 0, sizeof(expected));
+  expected.dev        = (uint64_t) file->st_dev;
+  expected.ino        = (uint64_t) file->st_ino;
+  expected.size       = (uint64_t) file->st_size;
+  expected.mtime_sec  = (int64_t) file->st_mtim.tv_sec;
+  expected.mtime_nsec = (int64_t) file->st_mtim.tv_nsec;
+  expected.ctime_sec  = (int64_t) file->st_ctim.tv_sec;
+  expected.ctime_nsec = (int64_t) file->st_ctim.tv_nsec;
+  expected.verdict    = slot->verdict;
+  expected.sum        = CheckCache_sum(&expected);
+  
+  if (memcmp(&expected, slot, sizeof(expected)) != 0) return false;
+  *verdict = slot->verdict;
+  return true;
+}
+
+void CheckCache_store(CheckCache *self, const struct stat *file, int verdict){
+  CheckCache_Entry *slot, entry;
+  time_t now = time(NULL);
+  assert(self && file);
+  
+  if (file->st_mtim.tv_sec + CheckCache_settleTime > now ||
+      file->st_ctim.tv_sec + CheckCache_settleTime > now)
+    return;
+  
+  if ((self->header->count+1)*2 > self->header->capacity &&
+      ! CheckCache_grow(self))
+    return;
+  
+  memset(&entry, 0, sizeof(entry));
+  entry.dev        = (uint64_t) file->st_dev;
+  entry.ino        = (uint64_t) file->st_ino;
+  entry.size       = (uint64_t) file->st_size;
+  entry.mtime_sec  = (int64_t) file->st_mtim.tv_sec;
+  entry.mtime_nsec = (int64_t) file->st_mtim.tv_nsec;
+  entry.ctime_sec  = (int64_t) file->st_ctim.tv_sec;
+  entry.ctime_nsec = (int64_t) file->st_ctim.tv_nsec;
+  entry.verdict    = (int32_t) verdict;
+  entry.sum        = CheckCache_sum(&entry);
+  
+  slot = CheckCache_slot(self->entries, self->header->capacity,
+                         entry.dev, entry.ino);
+  if (! slot) return;
+  if (slot->sum == 0) self->header->count++;
+  *slot = entry;
+}
+
+void CheckCache_close(CheckCache *self){
+  assert(self);
+  munmap(self->header, self->map_len);
+  close(self->fd);
+  free(self->path);
+  free(self);
+}
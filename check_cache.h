@@ -0,0 +1,65 @@
+#ifndef DEFINE_CHECK_CACHE_HEADER
+#define DEFINE_CHECK_CACHE_HEADER
+
+/*
+ ***********************************************************
+ * check_cache.h - Persistent cache of barcode verdicts    *
+ * -------------                                           *
+ * Remembers the result of Barcode_validateChecksum for    *
+ * files that were already checked, so that they don't     *
+ * need to be opened again while they are left unchanged.  *
+ * Files are identified by device and inode, and entries   *
+ * are only valid for the same size, mtime and ctime.      *
+ * The cache is a hash table in a file mapped in memory.   *
+ ***********************************************************
+ */
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+typedef struct CheckCache_t CheckCache;
+
+/*
+ * Open (or create) the cache stored at path. Fails if another process is
+ * using it, if it couldn't be created, or if path is a non-empty file which
+ * isn't a cache (it is never overwritten then).
+ * @pre : path is a valid non-empty C string
+ * @post: returns a new cache, or NULL if an error occured
+ */
+CheckCache *CheckCache_open(const char *path);
+
+/*
+ * @pre : /
+ * @post: returns the default cache path ($XDG_CACHE_HOME/checkbar.cache, or
+ *        $HOME/.cache/checkbar.cache) in a newly allocated string,
+ *        or NULL if neither variable is set or if an error occured
+ */
+char *CheckCache_defaultPath(void);
+
+/*
+ * @pre : self is a valid cache, file is the result of stat() on a file,
+ *        verdict is a valid pointer
+ * @post: if the file was stored unchanged, *verdict is set to the stored
+ *        value and true is returned. Otherwise returns false.
+ */
+bool CheckCache_lookup(CheckCache *self, const struct stat *file,
+                       int *verdict);
+
+/*
+ * Remember verdict (as returned by Barcode_validateChecksum) for file.
+ * Files changed too recently are not stored, as a later change within
+ * the timestamps granularity would go unnoticed.
+ * @pre : self is a valid cache, file is the result of stat() on a file
+ *        taken before reading it
+ * @post: verdict stored for file, unless an error occured
+ */
+void CheckCache_store(CheckCache *self, const struct stat *file, int verdict);
+
+/*
+ * @pre : self is a valid cache
+ * @post: cache written to disk, memory freed for self
+ */
+void CheckCache_close(CheckCache *self);
+
+#endif
@@ -1,7 +1,19 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#endif
 #include "barcode.h"
+#include "check_cache.h"
+#include "dir_walk.h"
+#include "id_index.h"
 
 /*
  ***************************************
@@ -10,81 +22,764 @@
  ***************************************
  */
 
+/* Size of ULg ID barcodes (data section), as rendered by the barcode program */
+#define ULG_BARCODE_SIZE 6
+
+/* Default maximal number of errors for --known */
+#define KNOWN_MAX_DIST 3
+
+/* Known IDs (--known), used to recover barcodes which can't be rectified */
+static IdIndex *known = NULL;
+
+/* A file as it was when checked, to recognize it later */
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime, ctime;
+} CheckedFile;
+
+/* Files checked before watching started (only with --watch), so that events
+ * queued for them in the meantime don't check them again */
+static CheckedFile *checked = NULL;
+static size_t checked_len = 0, checked_cap = 0;
+static bool remember_checked = false;
+
+/* Watched directories (--watch) */
+typedef struct Watch_t Watch;
+
 /*
  * Try to rectify a barcode. If successful, save correct version.
- * @pre : filename is a valid non-empty C string
- * @post: if image located at filename is an invalid barcode with one error, 
+ * @pre : filename is a valid non-empty C string, cache is a valid cache or
+ *        NULL
+ * @post: if image located at filename is an invalid barcode with one error,
  *        it is corrected and saved with '-rectified' suffix. If it has no
- *        error, or more than one error, nothing is done.
- *        Output an informative message on stdout
+ *        error, or more than one error, nothing is done (unless it is
+ *        close enough to a single known ID, which is then saved).
+ *        Modules are read by majority vote, smudged ones being used as
+ *        hints for the correction (see Barcode_validateWithHints).
+ *        Output an informative message on stdout.
+ *        Files found unchanged in cache are not read again.
+ */
+void quickCheck(char *filename, CheckCache *cache);
+
+/*
+ * @pre : filename is a valid C string ending with ".pbm"
+ * @post: returns a new string, filename with '-rectified' suffix,
+ *        or NULL if an error occured
+ */
+static char *rectifiedName(const char *filename);
+
+/*
+ * @pre : name is a valid C string
+ * @post: returns true if name is a barcode to check (a ".pbm" file which
+ *        isn't a rectified version of another)
+ */
+static bool acceptName(const char *name);
+
+/*
+ * Check every barcode found under root, while the tree is still walked
+ * @pre : root is a valid non-empty C string, cache is a valid cache or NULL
+ * @post: quickCheck done on every accepted file under root. Returns false
+ *        if root couldn't be walked.
+ */
+static bool checkTree(const char *root, CheckCache *cache);
+
+/*
+ * Start watching directories for barcodes being written or moved in them.
+ * Events are queued until watchRun, so it should be called before files
+ * already there are checked.
+ * @pre : dirs contains dirs_len valid non-empty C strings
+ * @post: returns a new watch, or NULL if no directory could be watched
+ */
+static Watch *watchStart(char **dirs, size_t dirs_len);
+
+/*
+ * Check barcodes of watched directories as soon as they arrive, files 
+ * arriving together being checked as a batch. Files found unchanged since
+ * rememberChecked are skipped.
+ * @pre : self is a valid watch
+ * @post: runs until no directory is left (or until interrupted), memory
+ *        freed for self
+ */
+static void watchRun(Watch *self);
+
+/*
+ * Remember filename as it is now, if remember_checked is set
+ * @pre : filename is a valid C string
+ */
+static void rememberChecked(const char *filename);
+
+/*
+ * Comparison of CheckedFile by device and inode, for qsort and bsearch
+ */
+static int compareChecked(const void *a, const void *b);
+
+/*
+ * Check a batch of barcodes with Barcode_validateBatch (those with smudged
+ * modules are checked one by one, with their hints)
+ * @pre : filenames contains n valid C strings ending with ".pbm"
+ * @post: same as quickCheck on each file, without cache
+ */
+static void checkBatch(char **filenames, size_t n);
+
+/*
+ * @pre : img is a valid PBM image
+ * @post: returns true if no pixel of img is set
  */
-void quickCheck(char *filename);
+static bool isBlank(PBM *img);
+
+/*
+ * Print verdict of a checked barcode, and save it if it was rectified
+ * @pre : filename is a valid C string ending with ".pbm", barcode is the
+ *        image read from it, verdict was returned by Barcode_validateChecksum
+ * @post: returns false if the rectified barcode couldn't be saved
+ */
+static bool reportVerdict(const char *filename, PBM *barcode, int verdict);
+
+/*
+ * @pre : error != PBM_NO_ERROR
+ * @post: reading error printed on stdout
+ */
+static void reportError(PBM_Error error);
+
+/*
+ * Print which known ID an unrectifiable barcode is, and save it as such
+ * @pre : known is loaded, same as reportVerdict
+ * @post: returns false if the recovered barcode couldn't be saved
+ */
+static bool reportKnown(const char *filename, PBM *barcode);
+
+static void usage(void);
 
 int main(int argc, char **argv){
-  int i;
+  CheckCache *cache = NULL;
+  char *cache_path = NULL;
+  char **roots, **watched, *known_path = NULL, *error;
+  Watch *watch = NULL;
+  unsigned long max_dist = KNOWN_MAX_DIST;
+  bool use_cache = true;
+  int i, roots_len = 0, watched_len = 0, status = EXIT_SUCCESS;
   
-  if (argc > 1){
-    for (i=1; i<argc; i++)
-      quickCheck(argv[i]);
-  } else {
-    printf("Usage: checkbar FILE1 [ FILE2 [...] ]\n"
-           "       where FILE is a path to a PBM file in the same format as "
-           "outputed by the barcode program.\n");
+  roots   = malloc(argc*sizeof(char *));
+  watched = malloc(argc*sizeof(char *));
+  if (! roots || ! watched){
+    free(roots);
+    free(watched);
+    fprintf(stderr, "Not enough available memory\n");
+    return EXIT_FAILURE;
   }
   
-  return EXIT_SUCCESS;
+  for (i=1; i<argc && argv[i][0] == '-'; i++){
+    if (strcmp("-r", argv[i]) == 0 && i+1<argc){
+      roots[roots_len++] = argv[++i];
+    } else if (strcmp("--watch", argv[i]) == 0 && i+1<argc){
+      watched[watched_len++] = argv[++i];
+    } else if (strcmp("--known", argv[i]) == 0 && i+1<argc){
+      known_path = argv[++i];
+    } else if (strcmp("--max-dist", argv[i]) == 0 && i+1<argc &&
+               (max_dist = strtoul(argv[i+1], &error, 10)) <= 
+                 ID_INDEX_MAX_DIST &&
+               error != argv[i+1] && *error == '\0'){
+      i++;
+    } else if (strcmp("--no-cache", argv[i]) == 0){
+      use_cache = false;
+    } else if (strcmp("--cache", argv[i]) == 0 && i+1<argc){
+      free(cache_path);
+      i++;
+      cache_path = malloc(strlen(argv[i])+1);
+      if (cache_path) strcpy(cache_path, argv[i]);
+    } else {
+      usage();
+      free(cache_path);
+      free(roots);
+      free(watched);
+      return EXIT_FAILURE;
+    }
+  }
+  
+  if (i >= argc && roots_len == 0 && watched_len == 0){
+    usage();
+    free(cache_path);
+    free(roots);
+    free(watched);
+    return EXIT_SUCCESS;
+  }
+  
+  if (known_path){
+    known = IdIndex_load(known_path, ULG_BARCODE_SIZE, (size_t) max_dist);
+    if (! known){
+      fprintf(stderr, "Unable to load known IDs from %s\n", known_path);
+      free(cache_path);
+      free(roots);
+      free(watched);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (use_cache){
+    if (! cache_path) cache_path = CheckCache_defaultPath();
+    if (cache_path) cache = CheckCache_open(cache_path);
+    if (! cache)
+      fprintf(stderr, 
+              "Warning: verification cache unavailable, checking all files\n");
+  }
+  
+  /* watching first, so that no file slips between checks and watching */
+  if (watched_len > 0){
+    watch = watchStart(watched, (size_t) watched_len);
+    if (! watch) status = EXIT_FAILURE;
+    remember_checked = (watch != NULL);
+  }
+  
+  for (; i<argc; i++){
+    rememberChecked(argv[i]);
+    quickCheck(argv[i], cache);
+  }
+  
+  for (i=0; i<roots_len; i++){
+    if (! checkTree(roots[i], cache)){
+      fprintf(stderr, "Unable to walk directory %s\n", roots[i]);
+      status = EXIT_FAILURE;
+    }
+  }
+  
+  if (cache) CheckCache_close(cache);
+  free(cache_path);
+  free(roots);
+  
+  /* files already there were checked above, wait for new ones */
+  if (watch){
+    fflush(stdout);
+    watchRun(watch);
+  }
+  free(watched);
+  if (known) IdIndex_destroy(known);
+  return status;
+}
+
+static bool acceptName(const char *name){
+  size_t name_len;
+  assert(name);
+  
+  name_len = strlen(name);
+  return name_len >= 4 && strcmp(&(name[name_len-4]), ".pbm") == 0 &&
+         (name_len < 14 || strcmp(&(name[name_len-14]), "-rectified.pbm"));
 }
 
-void quickCheck(char *filename){
+static bool checkTree(const char *root, CheckCache *cache){
+  DirWalk *walk;
+  char *path;
+  assert(root);
+  
+  /* discovery runs on walking threads, checking stays on this one */
+  walk = DirWalk_start(root, DirWalk_defaultThreads(), 1024, acceptName);
+  if (! walk) return false;
+  while ((path = DirWalk_next(walk))){
+    rememberChecked(path);
+    quickCheck(path, cache);
+    free(path);
+  }
+  DirWalk_end(walk);
+  return true;
+}
+
+static void rememberChecked(const char *filename){
+  struct stat info;
+  CheckedFile *grown;
+  assert(filename);
+  
+  /* before the file is read: if it changes after, it will be seen again */
+  if (! remember_checked || stat(filename, &info) != 0) return;
+  if (checked_len == checked_cap){
+    grown = realloc(checked, 
+                    ((checked_cap) ? 2*checked_cap : 1024)*sizeof(CheckedFile));
+    if (! grown) return;
+    checked     = grown;
+    checked_cap = (checked_cap) ? 2*checked_cap : 1024;
+  }
+  checked[checked_len].dev   = info.st_dev;
+  checked[checked_len].ino   = info.st_ino;
+  checked[checked_len].size  = info.st_size;
+  checked[checked_len].mtime = info.st_mtim;
+  checked[checked_len].ctime = info.st_ctim;
+  checked_len++;
+}
+
+static int compareChecked(const void *a, const void *b){
+  const CheckedFile *left = a, *right = b;
+  if (left->dev != right->dev) return (left->dev > right->dev) ? 1 : -1;
+  return (left->ino > right->ino) - (left->ino < right->ino);
+}
+
+static void usage(void){
+  printf("Usage: checkbar [ --no-cache | --cache CACHE ] [ -r DIR [...] ] "
+         "[ --watch DIR [...] ]\n"
+         "       [ --known IDS [ --max-dist K ] ] "
+         "[ FILE1 [ FILE2 [...] ] ]\n"
+         "       where FILE is a path to a PBM file in the same format as "
+         "outputed by the barcode program.\n"
+         "       With -r, every .pbm file under DIR is checked "
+         "(except rectified ones).\n"
+         "       With --watch DIR, files written or moved into DIR are "
+         "checked as they arrive.\n"
+         "       With --known IDS, unrectifiable barcodes at most K "
+         "(default 3) pixels away\n"
+         "       from a single ID of the IDS file are saved as that ID.\n"
+         "       Verdicts are remembered in CACHE (by default "
+         "$HOME/.cache/checkbar.cache),\n"
+         "       unchanged files are not checked again unless --no-cache "
+         "is given.\n");
+}
+
+static char *rectifiedName(const char *filename){
+  size_t filename_len;
+  char *res;
+  assert(filename);
+  
+  filename_len = strlen(filename);
+  assert(filename_len >= 4);
+  res = malloc((filename_len+11)*sizeof(char));
+  if (res){
+    strcpy(res, filename);
+    strcpy(&(res[filename_len-4]), "-rectified.pbm");
+  }
+  return res;
+}
+
+void quickCheck(char *filename, CheckCache *cache){
   PBM_Error read_error;
   char  *new_filename=NULL;
   size_t filename_len=0;
-  PBM *barcode = NULL;
+  PBM *barcode = NULL, *hints = NULL;
+  struct stat file_info, rectified_info;
+  bool has_info = false;
+  int verdict;
   
   assert(filename);
   filename_len = strlen(filename);
   assert(filename_len > 0);
   
-  barcode = PBM_openP1(filename, 10, &read_error);
+  /* verdict of an unchanged file, if its rectified version is still there */
+  if (cache && stat(filename, &file_info) == 0){
+    has_info = true;
+    /* unrectifiable barcodes could be recovered from known IDs */
+    if (CheckCache_lookup(cache, &file_info, &verdict) &&
+        (verdict != -1 || ! known)){
+      new_filename = (verdict == 1) ? rectifiedName(filename) : NULL;
+      if (verdict != 1 ||
+          (new_filename && stat(new_filename, &rectified_info) == 0)){
+        printf("Checking %s... ", filename);
+        switch (verdict){
+          case 0:  printf("valid.\n"); break;
+          case 1:  printf("rectified. Saved as %s\n", new_filename); break;
+          default: printf("unable to rectify !!!\n"); break;
+        }
+        free(new_filename);
+        return;
+      }
+      free(new_filename);
+      new_filename = NULL;
+    }
+  }
+  
+  barcode = PBM_openP1Vote(filename, 10, &hints, &read_error);
   
   printf("Checking %s... ", filename);
   
   if (read_error == PBM_NO_ERROR){
-    switch (Barcode_validateChecksum(barcode)){
-      case 0:  printf("valid.\n"); break;
-      case 1:  
-        printf("rectified. "); 
-        new_filename = malloc((filename_len+11)*sizeof(char));
-        if (new_filename){
-          strcpy(new_filename, filename);
-          strcpy(&(new_filename[filename_len-4]), "-rectified.pbm");
-          if (PBM_saveP1(barcode, new_filename, 10))
-            printf("Saved as %s", new_filename);
-          else
-            printf("Error when saving as %s", new_filename);
-          free(new_filename);
-        }
-        printf("\n");
-        break;
-      default: printf("unable to rectify !!!\n"); break;
-    }
+    verdict = Barcode_validateWithHints(barcode, hints);
+    /* don't remember unsaved corrections */
+    if (reportVerdict(filename, barcode, verdict) && has_info)
+      CheckCache_store(cache, &file_info, verdict);
   } else {
-    printf("Error when reading file: ");
-    switch (read_error){
-      case PBM_MAGIC_ERROR: 
-        printf("unknow magic number"); break;
-      case PBM_FORMAT_ERROR:
-        printf("unexpected format"); break;
-      case PBM_LENGTH_ERROR:
-        printf("length error"); break;
-      case PBM_MEMORY_ERROR:
-        printf("not enough available memory"); break;
-      case PBM_FILENOTFOUND:
-        printf("file not found"); break;
-      default : break;
-    }
-    printf("\n");
+    reportError(read_error);
   }
   
   if (barcode) PBM_destroy(barcode);
+  if (hints)   PBM_destroy(hints);
+}
+
+static bool isBlank(PBM *img){
+  size_t width, height, x, y;
+  assert(img);
+  
+  PBM_size(img, &width, &height);
+  for (y=0; y<height; y++)
+    for (x=0; x<width; x++)
+      if (PBM_get(img, x, y)) return false;
+  return true;
+}
+
+static bool reportVerdict(const char *filename, PBM *barcode, int verdict){
+  char *new_filename;
+  bool saved = true;
+  assert(filename && barcode);
+  
+  switch (verdict){
+    case 0:  printf("valid.\n"); break;
+    case 1:
+      printf("rectified. ");
+      new_filename = rectifiedName(filename);
+      if (new_filename){
+        saved = PBM_saveP1(barcode, new_filename, 10);
+        if (saved)
+          printf("Saved as %s", new_filename);
+        else
+          printf("Error when saving as %s", new_filename);
+        free(new_filename);
+      }
+      printf("\n");
+      break;
+    default:
+      if (known) return reportKnown(filename, barcode);
+      printf("unable to rectify !!!\n");
+      break;
+  }
+  return saved;
+}
+
+static bool reportKnown(const char *filename, PBM *barcode){
+  unsigned long long id;
+  char *new_filename;
+  PBM *recovered;
+  bool saved = true;
+  assert(filename && barcode && known);
+  
+  switch (IdIndex_resolve(known, barcode, &id)){
+    case ID_INDEX_FOUND:
+      printf("recovered as known ID %llu. ", id);
+      recovered    = Barcode_renderULL(id, IdIndex_size(known));
+      new_filename = rectifiedName(filename);
+      if (recovered && new_filename){
+        saved = PBM_saveP1(recovered, new_filename, 10);
+        if (saved)
+          printf("Saved as %s", new_filename);
+        else
+          printf("Error when saving as %s", new_filename);
+      }
+      printf("\n");
+      free(new_filename);
+      if (recovered) PBM_destroy(recovered);
+      break;
+    case ID_INDEX_AMBIGUOUS:
+      printf("unable to rectify, several known IDs match !!!\n");
+      break;
+    default: printf("unable to rectify !!!\n"); break;
+  }
+  return saved;
+}
+
+static void reportError(PBM_Error error){
+  printf("Error when reading file: ");
+  switch (error){
+    case PBM_MAGIC_ERROR:
+      printf("unknow magic number"); break;
+    case PBM_FORMAT_ERROR:
+      printf("unexpected format"); break;
+    case PBM_LENGTH_ERROR:
+      printf("length error"); break;
+    case PBM_MEMORY_ERROR:
+      printf("not enough available memory"); break;
+    case PBM_FILENOTFOUND:
+      printf("file not found"); break;
+    default : break;
+  }
+  printf("\n");
+}
+  
+static void checkBatch(char **filenames, size_t n){
+  PBM **barcodes, **hints, **batch;
+  PBM_Error *errors;
+  int *verdicts, *batch_verdicts;
+  size_t i, loaded = 0, batch_len = 0, *slots;
+  assert(filenames);
+  
+  barcodes = malloc(n*sizeof(PBM *));
+  hints    = malloc(n*sizeof(PBM *));
+  batch    = malloc(n*sizeof(PBM *));
+  errors   = malloc(n*sizeof(PBM_Error));
+  verdicts = malloc(n*sizeof(int));
+  batch_verdicts = malloc(n*sizeof(int));
+  slots    = malloc(n*sizeof(size_t));
+  if (! barcodes || ! hints || ! batch || ! errors || ! verdicts ||
+      ! batch_verdicts || ! slots){
+    free(barcodes);
+    free(hints);
+    free(batch);
+    free(errors);
+    free(verdicts);
+    free(batch_verdicts);
+    free(slots);
+    for (i=0; i<n; i++)
+      quickCheck(filenames[i], NULL);
+    return;
+  }
+
+  /* readable barcodes are packed at the front of barcodes */
+  for (i=0; i<n; i++){
+    barcodes[loaded] = PBM_openP1Vote(filenames[i], 10, &(hints[loaded]),
+                                      &(errors[i]));
+    if (errors[i] == PBM_NO_ERROR){
+      loaded++;
+      continue;
+    }
+    if (barcodes[loaded]) PBM_destroy(barcodes[loaded]);
+    if (hints[loaded])    PBM_destroy(hints[loaded]);
+  }
+  
+  /* clean barcodes are checked together, smudged ones with their hints */
+  for (i=0; i<loaded; i++){
+    if (isBlank(hints[i])){
+      slots[batch_len] = i;
+      batch[batch_len++] = barcodes[i];
+    } else {
+      verdicts[i] = Barcode_validateWithHints(barcodes[i], hints[i]);
+    }
+  }
+  Barcode_validateBatch(batch, batch_len, batch_verdicts);
+  for (i=0; i<batch_len; i++)
+    verdicts[slots[i]] = batch_verdicts[i];
+  
+  loaded = 0;
+  for (i=0; i<n; i++){
+    printf("Checking %s... ", filenames[i]);
+    if (errors[i] == PBM_NO_ERROR){
+      reportVerdict(filenames[i], barcodes[loaded], verdicts[loaded]);
+      PBM_destroy(barcodes[loaded]);
+      PBM_destroy(hints[loaded]);
+      loaded++;
+    } else {
+      reportError(errors[i]);
+    }
+  }
+  
+  free(barcodes);
+  free(hints);
+  free(batch);
+  free(errors);
+  free(verdicts);
+  free(batch_verdicts);
+  free(slots);
+}
+
+#ifdef __linux__
+
+/* Largest number of files checked in one batch */
+#define WATCH_BATCH_LEN 256
+
+/* Milliseconds without new file before a batch is checked */
+#define WATCH_SETTLE_MS 5
+
+struct Watch_t {
+  int    fd;                      /* inotify instance */
+  char **dirs;
+  int   *watches;                 /* watch of dirs[i], -1 once removed */
+  size_t dirs_len, active;
+  char  *batch[WATCH_BATCH_LEN];  /* files waiting to be checked */
+  size_t batch_len;
+};
+
+/*
+ * @pre : path is a valid C string
+ * @post: returns true if path is a file rememberChecked saw, unchanged since
+ */
+static bool watchUnchanged(const char *path);
+
+/*
+ * Queue dir/name in the batch of self, unless it was already queued, or
+ * it isn't a barcode. A full batch is checked at once.
+ * @pre : self is a valid watch, dir and name are valid C strings
+ */
+static void watchQueue(Watch *self, const char *dir, const char *name);
+
+/*
+ * Check the batch of self, and empty it
+ * @pre : self is a valid watch
+ */
+static void watchFlush(Watch *self);
+
+/*
+ * Queue every barcode in watched directories, when events were lost
+ * @pre : self is a valid watch
+ */
+static void watchRescan(Watch *self);
+
+static bool watchUnchanged(const char *path){
+  CheckedFile key, *found;
+  struct stat info;
+  assert(path);
+  
+  if (checked_len == 0 || stat(path, &info) != 0) return false;
+  key.dev = info.st_dev;
+  key.ino = info.st_ino;
+  found = bsearch(&key, checked, checked_len, sizeof(CheckedFile), 
+                  compareChecked);
+  return found && found->size == info.st_size &&
+         found->mtime.tv_sec  == info.st_mtim.tv_sec &&
+         found->mtime.tv_nsec == info.st_mtim.tv_nsec &&
+         found->ctime.tv_sec  == info.st_ctim.tv_sec &&
+         found->ctime.tv_nsec == info.st_ctim.tv_nsec;
+}
+
+static void watchQueue(Watch *self, const char *dir, const char *name){
+  char *path;
+  size_t i;
+  assert(self && dir && name);
+  
+  if (! acceptName(name)) return;
+  path = malloc(strlen(dir) + strlen(name) + 2);
+  if (! path) return;
+  sprintf(path, "%s/%s", dir, name);
+  
+  /* a file written twice in a burst is only checked once */
+  for (i=0; i<self->batch_len && strcmp(self->batch[i], path) != 0; i++);
+  if (i < self->batch_len || watchUnchanged(path)){
+    free(path);
+    return;
+  }
+  self->batch[self->batch_len++] = path;
+  if (self->batch_len == WATCH_BATCH_LEN) watchFlush(self);
+}
+
+static void watchFlush(Watch *self){
+  size_t i;
+  assert(self);
+  
+  checkBatch(self->batch, self->batch_len);
+  fflush(stdout);
+  for (i=0; i<self->batch_len; i++)
+    free(self->batch[i]);
+  self->batch_len = 0;
 }
+
+static void watchRescan(Watch *self){
+  DIR *handle;
+  struct dirent *entry;
+  size_t i;
+  assert(self);
+  
+  for (i=0; i<self->dirs_len; i++){
+    if (self->watches[i] < 0) continue;
+    handle = opendir(self->dirs[i]);
+    if (! handle) continue;
+    while ((entry = readdir(handle)))
+      watchQueue(self, self->dirs[i], entry->d_name);
+    closedir(handle);
+  }
+}
+
+static Watch *watchStart(char **dirs, size_t dirs_len){
+  Watch *res;
+  size_t i;
+  assert(dirs);
+  
+  res = malloc(sizeof(Watch));
+  if (res) res->watches = malloc(dirs_len*sizeof(int));
+  if (res) res->fd = inotify_init1(IN_CLOEXEC);
+  if (! res || ! res->watches || res->fd < 0){
+    if (res) free(res->watches);
+    if (res && res->fd >= 0) close(res->fd);
+    free(res);
+    fprintf(stderr, "Unable to watch directories\n");
+    return NULL;
+  }
+  
+  res->dirs      = dirs;
+  res->dirs_len  = dirs_len;
+  res->active    = 0;
+  res->batch_len = 0;
+  for (i=0; i<dirs_len; i++){
+    res->watches[i] = inotify_add_watch(res->fd, dirs[i], 
+                                        IN_CLOSE_WRITE | IN_MOVED_TO | 
+                                        IN_ONLYDIR);
+    if (res->watches[i] < 0)
+      fprintf(stderr, "Unable to watch directory %s\n", dirs[i]);
+    else
+      res->active++;
+  }
+  if (res->active == 0){
+    free(res->watches);
+    close(res->fd);
+    free(res);
+    return NULL;
+  }
+  return res;
+}
+
+static void watchRun(Watch *self){
+  union {
+    struct inotify_event event; /* for alignment */
+    char bytes[4096];
+  } buffer;
+  struct inotify_event *event;
+  int timeout, ready;
+  size_t i;
+  ssize_t len, pos;
+  struct pollfd pfd;
+  assert(self);
+  
+  /* files checked before are looked up by device and inode */
+  remember_checked = false;
+  qsort(checked, checked_len, sizeof(CheckedFile), compareChecked);
+  
+  pfd.fd     = self->fd;
+  pfd.events = POLLIN;
+  while (self->active > 0){
+    /* a burst of files is gathered until it settles. Events queued before
+     * watchRun are all read once it settled for the first time. */
+    timeout = (self->batch_len > 0 || checked) ? WATCH_SETTLE_MS : -1;
+    ready = poll(&pfd, 1, timeout);
+    if (ready < 0 && errno != EINTR) break;
+    if (ready == 0){
+      watchFlush(self);
+      free(checked);
+      checked     = NULL;
+      checked_len = 0;
+      continue;
+    }
+  
+    len = (ready > 0) ? read(self->fd, buffer.bytes, sizeof(buffer.bytes)) : 0;
+    if (len < 0 && errno != EINTR) break;
+    for (pos=0; pos<len; pos+=sizeof(struct inotify_event)+event->len){
+      event = (struct inotify_event *) &(buffer.bytes[pos]);
+      if (event->mask & IN_Q_OVERFLOW){
+        fprintf(stderr, "Warning: too many files at once, rescanning "
+                        "watched directories\n");
+        watchRescan(self);
+        continue;
+      }
+      for (i=0; i<self->dirs_len && self->watches[i] != event->wd; i++);
+      if (i == self->dirs_len) continue;
+      if (event->mask & IN_IGNORED){
+        self->watches[i] = -1;
+        self->active--;
+        continue;
+      }
+      if (event->len > 0) watchQueue(self, self->dirs[i], event->name);
+    }
+  }
+  
+  watchFlush(self);
+  free(checked);
+  checked     = NULL;
+  checked_len = 0;
+  free(self->watches);
+  close(self->fd);
+  free(self);
+}
+
+#else
+
+static Watch *watchStart(char **dirs, size_t dirs_len){
+  (void) dirs;
+  (void) dirs_len;
+  fprintf(stderr, "--watch is only available on Linux\n");
+  return NULL;
+}
+
+static void watchRun(Watch *self){
+  (void) self;
+}
+
+#endif
@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#include "dir_walk.h"
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/* PRIVATE HEADER */
+
+/* Directories waiting to be read hold an opened descriptor, up to this
+ * number; others are reopened from their path when their turn comes */
+static const size_t DirWalk_maxFds = 256;
+
+/* Maximum number of walking threads chosen by DirWalk_defaultThreads */
+static const long DirWalk_maxThreads = 16;
+
+/* Size of the buffer for batched directory entries reads */
+#define DIRWALK_BUFFER_LEN 65536
+
+/* A directory waiting to be read */
+typedef struct DirWalk_Dir_t {
+  char *path;
+  int   fd;     /* -1 if not opened yet */
+  struct DirWalk_Dir_t *next;
+} DirWalk_Dir;
+
+struct DirWalk_t {
+  pthread_mutex_t lock;       /* protects everything below */
+  pthread_cond_t  has_dirs;   /* dirs not empty, or walk over */
+  pthread_cond_t  has_files;  /* files not empty, or walk over */
+  pthread_cond_t  has_room;   /* files not full, or stopped */
+  
+  DirWalk_Dir *dirs;          /* stack of directories to read */
+  size_t       open_fds;      /* descriptors held by dirs */
+  size_t       busy;          /* threads reading a directory */
+  
+  char       **files;         /* ring buffer of accepted paths */
+  size_t       files_len, files_start, files_count;
+  
+  pthread_t   *threads;
+  size_t       threads_len, running;
+  bool         stop;          /* set by DirWalk_end */
+  bool (*accept)(const char *name);
+};
+
+/*
+ * Main function of walking threads: read directories until there is none
+ * left and no other thread could find new ones
+ * @pre : arg is a valid walk
+ */
+static void *DirWalk_run(void *arg);
+
+/*
+ * List a directory, pushing its subdirectories on the stack and its
+ * accepted files in the queue
+ * @pre : self is a valid walk, dir was popped from its stack
+ * @post: dir is closed and freed
+ */
+static void DirWalk_read(DirWalk *self, DirWalk_Dir *dir);
+
+/*
+ * Handle an entry of dir, of type DT_* (DT_UNKNOWN if not known)
+ * @pre : dir.fd is an opened directory, name is an entry of it
+ */
+static void DirWalk_entry(DirWalk *self, DirWalk_Dir *dir,
+                          const char *name, unsigned char type);
+
+/*
+ * @pre : base and name are valid C strings
+ * @post: returns base/name in a newly allocated string, or NULL
+ */
+static char *DirWalk_join(const char *base, const char *name);
+
+/*
+ * Wait for room in the queue and append path to it
+ * @pre : self is a valid walk, path a newly allocated string
+ * @post: path is queued, or freed if the walk was stopped
+ */
+static void DirWalk_pushFile(DirWalk *self, char *path);
+
+
+/* PRIVATE IMPLEMENTATION */
+
+static char *DirWalk_join(const char *base, const char *name){
+  size_t base_len = strlen(base);
+  char *res;
+  
+  res = malloc(base_len + strlen(name) + 2);
+  if (! res) return NULL;
+  strcpy(res, base);
+  if (base_len == 0 || base[base_len-1] != '/') strcat(res, "/");
+  strcat(res, name);
+  return res;
+}
+
+static void DirWalk_pushFile(DirWalk *self, char *path){
+  pthread_mutex_lock(&self->lock);
+  while (self->files_count == self->files_len && ! self->stop)
+    pthread_cond_wait(&self->has_room, &self->lock);
+  if (self->stop){
+    pthread_mutex_unlock(&self->lock);
+    free(path);
+    return;
+  }
+  self->files[(self->files_start+self->files_count) % self->files_len] = path;
+  self->files_count++;
+  pthread_cond_signal(&self->has_files);
+  pthread_mutex_unlock(&self->lock);
+}
+
+static void DirWalk_entry(DirWalk *self, DirWalk_Dir *dir,
+                          const char *name, unsigned char type)
+{
+  DirWalk_Dir *child;
+  struct stat info;
+  char *path;
+  
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return;
+  
+  /* symbolic links are followed to files, never to directories */
+  if (type == DT_UNKNOWN || type == DT_LNK){
+    if (fstatat(dir->fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0) return;
+    if (S_ISDIR(info.st_mode)) type = DT_DIR;
+    else if (S_ISREG(info.st_mode)) type = DT_REG;
+    else if (S_ISLNK(info.st_mode) && fstatat(dir->fd, name, &info, 0) == 0 &&
+             S_ISREG(info.st_mode))
+      type = DT_REG;
+    else return;
+  }
+  
+  if (type == DT_REG){
+    if (! self->accept(name)) return;
+    path = DirWalk_join(dir->path, name);
+    if (path) DirWalk_pushFile(self, path);
+    return;
+  }
+  if (type != DT_DIR) return;
+  
+  child = malloc(sizeof(DirWalk_Dir));
+  if (! child) return;
+  child->path = DirWalk_join(dir->path, name);
+  if (! child->path){
+    free(child);
+    return;
+  }
+  
+  pthread_mutex_lock(&self->lock);
+  child->fd = -1;
+  if (self->open_fds < DirWalk_maxFds){
+    child->fd = openat(dir->fd, name,
+                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (child->fd >= 0) self->open_fds++;
+  }
+  child->next = self->dirs;
+  self->dirs  = child;
+  pthread_cond_signal(&self->has_dirs);
+  pthread_mutex_unlock(&self->lock);
+}
+
+static void DirWalk_read(DirWalk *self, DirWalk_Dir *dir){
+#ifdef __linux__
+  /* raw getdents64 records, read by large batches */
+  struct linux_dirent64 {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+  } *entry;
+  char *buffer;
+  long len, pos;
+#else
+  DIR *handle;
+  struct dirent *entry;
+#endif
+  bool held = (dir->fd >= 0);
+  
+  if (! held)
+    dir->fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  
+  if (dir->fd >= 0){
+#ifdef __linux__
+    buffer = malloc(DIRWALK_BUFFER_LEN);
+    while (buffer &&
+           (len = syscall(SYS_getdents64, dir->fd, buffer,
+                          DIRWALK_BUFFER_LEN)) > 0){
+      for (pos=0; pos<len; pos+=entry->d_reclen){
+        entry = (struct linux_dirent64 *) (buffer+pos);
+        DirWalk_entry(self, dir, entry->d_name, entry->d_type);
+      }
+    }
+    free(buffer);
+    close(dir->fd);
+#else
+    handle = fdopendir(dir->fd);
+    if (handle){
+      while ((entry = readdir(handle)))
+        DirWalk_entry(self, dir, entry->d_name, DT_UNKNOWN);
+      closedir(handle);
+    } else {
+      close(dir->fd);
+    }
+#endif
+  }
+  
+  if (held){
+    pthread_mutex_lock(&self->lock);
+    self->open_fds--;
+    pthread_mutex_unlock(&self->lock);
+  }
+  free(dir->path);
+  free(dir);
+}
+
+static void *DirWalk_run(void *arg){
+  DirWalk *self = arg;
+  DirWalk_Dir *dir;
+  assert(self);
+  
+  pthread_mutex_lock(&self->lock);
+  for (;;){
+    /* other threads could still find directories while they are busy */
+    while (! self->dirs && self->busy > 0 && ! self->stop)
+      pthread_cond_wait(&self->has_dirs, &self->lock);
+    if (! self->dirs || self->stop) break;
+    
+    dir = self->dirs;
+    self->dirs = dir->next;
+    self->busy++;
+    pthread_mutex_unlock(&self->lock);
+    
+    DirWalk_read(self, dir);
+    
+    pthread_mutex_lock(&self->lock);
+    self->busy--;
+    if (self->busy == 0 && ! self->dirs)
+      pthread_cond_broadcast(&self->has_dirs);
+  }
+  
+  self->running--;
+  if (self->running == 0)
+    pthread_cond_broadcast(&self->has_files);
+  pthread_mutex_unlock(&self->lock);
+  return NULL;
+}
+
+
+/* PUBLIC IMPLEMENTATION */
+
+DirWalk *DirWalk_start(const char *root, size_t threads, size_t queue_len,
+                       bool (*accept)(const char *name))
+{
+  DirWalk *res;
+  DirWalk_Dir *dir;
+  size_t i;
+  assert(root && strlen(root) > 0);
+  assert(threads > 0 && queue_len > 0);
+  assert(accept);
+  
+  res = calloc(1, sizeof(DirWalk));
+  if (! res) return NULL;
+  dir = malloc(sizeof(DirWalk_Dir));
+  res->files   = malloc(queue_len*sizeof(char *));
+  res->threads = malloc(threads*sizeof(pthread_t));
+  if (dir) dir->path = malloc(strlen(root)+1);
+  if (! dir || ! dir->path || ! res->files || ! res->threads){
+    if (dir) free(dir->path);
+    free(dir);
+    free(res->files);
+    free(res->threads);
+    free(res);
+    return NULL;
+  }
+  
+  strcpy(dir->path, root);
+  dir->fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  dir->next = NULL;
+  if (dir->fd < 0){
+    free(dir->path);
+    free(dir);
+    free(res->files);
+    free(res->threads);
+    free(res);
+    return NULL;
+  }
+  
+  pthread_mutex_init(&res->lock, NULL);
+  pthread_cond_init(&res->has_dirs, NULL);
+  pthread_cond_init(&res->has_files, NULL);
+  pthread_cond_init(&res->has_room, NULL);
+  res->dirs      = dir;
+  res->open_fds  = 1;
+  res->files_len = queue_len;
+  res->accept    = accept;
+  
+  pthread_mutex_lock(&res->lock);
+  for (i=0; i<threads; i++){
+    if (pthread_create(&(res->threads[i]), NULL, DirWalk_run, res) != 0)
+      break;
+    res->running++;
+  }
+  res->threads_len = i;
+  pthread_mutex_unlock(&res->lock);
+  
+  if (res->threads_len == 0){
+    DirWalk_end(res);
+    return NULL;
+  }
+  return res;
+}
+
+char *DirWalk_next(DirWalk *self){
+  char *res = NULL;
+  assert(self);
+  
+  pthread_mutex_lock(&self->lock);
+  while (self->files_count == 0 && self->running > 0)
+    pthread_cond_wait(&self->has_files, &self->lock);
+  if (self->files_count > 0){
+    res = self->files[self->files_start];
+    self->files_start = (self->files_start+1) % self->files_len;
+    self->files_count--;
+    pthread_cond_signal(&self->has_room);
+  }
+  pthread_mutex_unlock(&self->lock);
+  return res;
+}
+
+void DirWalk_end(DirWalk *self){
+  DirWalk_Dir *dir;
+  size_t i;
+  assert(self);
+  
+  pthread_mutex_lock(&self->lock);
+  self->stop = true;
+  pthread_cond_broadcast(&self->has_dirs);
+  pthread_cond_broadcast(&self->has_room);
+  pthread_mutex_unlock(&self->lock);
+  
+  for (i=0; i<self->threads_len; i++)
+    pthread_join(self->threads[i], NULL);
+  
+  /* leftovers of an interrupted walk */
+  while (self->dirs){
+    dir = self->dirs;
+    self->dirs = dir->next;
+    if (dir->fd >= 0) close(dir->fd);
+    free(dir->path);
+    free(dir);
+  }
+  for (i=0; i<self->files_count; i++)
+    free(self->files[(self->files_start+i) % self->files_len]);
+  
+  pthread_mutex_destroy(&self->lock);
+  pthread_cond_destroy(&self->has_dirs);
+  pthread_cond_destroy(&self->has_files);
+  pthread_cond_destroy(&self->has_room);
+  free(self->files);
+  free(self->threads);
+  free(self);
+}
+
+size_t DirWalk_defaultThreads(void){
+  long res = sysconf(_SC_NPROCESSORS_ONLN);
+  if (res < 1) res = 1;
+  if (res > DirWalk_maxThreads) res = DirWalk_maxThreads;
+  return (size_t) res;
+}
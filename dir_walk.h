@@ -0,0 +1,52 @@
+#ifndef DEFINE_DIR_WALK_HEADER
+#define DEFINE_DIR_WALK_HEADER
+
+/*
+ ***********************************************************
+ * dir_walk.h - Parallel recursive directory discovery     *
+ * ----------                                              *
+ * Several threads walk a directory tree, opening          *
+ * subdirectories relative to their parent, and feed the   *
+ * paths of accepted files to a bounded queue. Files could *
+ * be processed while the tree is still being walked.      *
+ ***********************************************************
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct DirWalk_t DirWalk;
+
+/*
+ * Start walking the tree under root.
+ * @pre : root is a valid non-empty C string, threads>0, queue_len>0,
+ *        accept != NULL and could be called from several threads at once
+ * @post: returns a new walk, or NULL if root isn't a readable directory or
+ *        if an error occured. Regular files whose name is accepted will be
+ *        given by DirWalk_next; at most queue_len of them are waiting.
+ */
+DirWalk *DirWalk_start(const char *root, size_t threads, size_t queue_len,
+                       bool (*accept)(const char *name));
+
+/*
+ * Wait for the next accepted file
+ * @pre : self is a valid walk
+ * @post: returns the path of a file (root/.../name) in a newly allocated
+ *        string to be freed, or NULL once the whole tree was walked
+ */
+char *DirWalk_next(DirWalk *self);
+
+/*
+ * Stop walking (if it isn't over) and wait for threads to finish
+ * @pre : self is a valid walk
+ * @post: memory freed for self
+ */
+void DirWalk_end(DirWalk *self);
+
+/*
+ * @pre : /
+ * @post: returns a sensible number of walking threads for this machine
+ */
+size_t DirWalk_defaultThreads(void);
+
+#endif
@@ -0,0 +1,274 @@
+#include "id_index.h"
+#include "barcode.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* PRIVATE HEADER */
+
+/* Minimal number of chunks, so that none is wider than 16 bits */
+static const size_t IdIndex_minChunks = 4;
+
+/* Table of one chunk: the codewords whose chunk is v are
+ * members[starts[v]..starts[v+1]-1] */
+typedef struct {
+  size_t    shift, bits;  /* chunk is (codeword>>shift) & (2^bits-1) */
+  uint32_t *starts;       /* 2^bits+1 offsets in members */
+  uint32_t *members;      /* n indexes in codes */
+} IdIndex_Chunk;
+
+/* A known ID and its codeword, while building the index */
+typedef struct {
+  uint64_t           code;
+  unsigned long long id;
+} IdIndex_Entry;
+
+struct IdIndex_t {
+  size_t    size, max_dist;
+  size_t    n;            /* number of distinct known IDs */
+  uint64_t *codes;        /* codes[i] is the codeword of ids[i] */
+  unsigned long long *ids;
+  size_t        chunks_len;
+  IdIndex_Chunk chunks[ID_INDEX_MAX_DIST+1];
+};
+
+/*
+ * @pre : barcode is a valid (size+1)x(size+1) PBM image, size<=7
+ * @post: returns the pixels of barcode, row after row, pixel [0,0] in the
+ *        least significant bit
+ */
+static uint64_t IdIndex_codeword(PBM *barcode, size_t size);
+
+/*
+ * @post: returns the number of bits set in word
+ */
+static inline size_t IdIndex_popcount(uint64_t word);
+
+/*
+ * Comparison of IdIndex_Entry by codeword, for qsort
+ */
+static int IdIndex_compare(const void *a, const void *b);
+
+/*
+ * Fill the table of chunk with the codewords of self
+ * @pre : self.codes and self.n are set, chunk.shift and chunk.bits too
+ * @post: returns false if an allocation error occured
+ */
+static bool IdIndex_fillChunk(IdIndex *self, IdIndex_Chunk *chunk);
+
+
+/* PRIVATE IMPLEMENTATION */
+
+static uint64_t IdIndex_codeword(PBM *barcode, size_t size){
+  uint64_t res = 0;
+  size_t row;
+  assert(barcode);
+  
+  for (row=0; row<=size; row++)
+    res |= (uint64_t) PBM_getBits(barcode, 0, row, size+1) << (row*(size+1));
+  return res;
+}
+
+static inline size_t IdIndex_popcount(uint64_t word){
+#ifdef __GNUC__
+  return (size_t) __builtin_popcountll(word);
+#else
+  size_t res = 0;
+  for (; word; word &= word-1) res++;
+  return res;
+#endif
+}
+
+static int IdIndex_compare(const void *a, const void *b){
+  const IdIndex_Entry *left = a, *right = b;
+  return (left->code > right->code) - (left->code < right->code);
+}
+
+static bool IdIndex_fillChunk(IdIndex *self, IdIndex_Chunk *chunk){
+  size_t i, values = ((size_t) 1) << chunk->bits;
+  uint64_t mask = (((uint64_t) 1) << chunk->bits) - 1;
+  uint32_t *next;
+  assert(self && chunk);
+  
+  chunk->starts  = calloc(values+1, sizeof(uint32_t));
+  chunk->members = malloc((self->n ? self->n : 1)*sizeof(uint32_t));
+  next           = malloc(values*sizeof(uint32_t));
+  if (! chunk->starts || ! chunk->members || ! next){
+    free(next);
+    return false;
+  }
+  
+  /* counting sort of codewords by chunk value */
+  for (i=0; i<self->n; i++)
+    chunk->starts[((self->codes[i] >> chunk->shift) & mask) + 1]++;
+  for (i=0; i<values; i++){
+    chunk->starts[i+1] += chunk->starts[i];
+    next[i] = chunk->starts[i];
+  }
+  for (i=0; i<self->n; i++)
+    chunk->members[next[(self->codes[i] >> chunk->shift) & mask]++] =
+      (uint32_t) i;
+  
+  free(next);
+  return true;
+}
+
+
+/* PUBLIC IMPLEMENTATION */
+
+IdIndex *IdIndex_create(const unsigned long long *ids, size_t n, size_t size,
+                        size_t max_dist)
+{
+  IdIndex *res;
+  IdIndex_Entry *entries;
+  PBM *barcode;
+  size_t i, bits, shift;
+  assert(ids || n == 0);
+  assert(size > 0 && size <= 7);
+  assert(max_dist <= ID_INDEX_MAX_DIST);
+  
+  if (n > UINT32_MAX) return NULL;
+  res = calloc(1, sizeof(IdIndex));
+  if (! res) return NULL;
+  res->size     = size;
+  res->max_dist = max_dist;
+  
+  entries = malloc((n ? n : 1)*sizeof(IdIndex_Entry));
+  if (! entries){
+    free(res);
+    return NULL;
+  }
+  for (i=0; i<n; i++){
+    barcode = Barcode_renderULL(ids[i], size);
+    if (! barcode){
+      free(entries);
+      free(res);
+      return NULL;
+    }
+    entries[i].code = IdIndex_codeword(barcode, size);
+    entries[i].id   = ids[i];
+    PBM_destroy(barcode);
+  }
+  
+  /* a known ID listed twice is indexed once */
+  qsort(entries, n, sizeof(IdIndex_Entry), IdIndex_compare);
+  res->codes = malloc((n ? n : 1)*sizeof(uint64_t));
+  res->ids   = malloc((n ? n : 1)*sizeof(unsigned long long));
+  if (! res->codes || ! res->ids){
+    free(entries);
+    IdIndex_destroy(res);
+    return NULL;
+  }
+  for (i=0; i<n; i++){
+    if (res->n > 0 && res->codes[res->n-1] == entries[i].code) continue;
+    res->codes[res->n] = entries[i].code;
+    res->ids[res->n]   = entries[i].id;
+    res->n++;
+  }
+  free(entries);
+  
+  /* max_dist+1 chunks, as even as possible */
+  bits = (size+1)*(size+1);
+  res->chunks_len = max_dist+1;
+  if (res->chunks_len < IdIndex_minChunks) res->chunks_len = IdIndex_minChunks;
+  if (res->chunks_len > bits) res->chunks_len = bits;
+  for (i=0, shift=0; i<res->chunks_len; i++){
+    res->chunks[i].shift = shift;
+    res->chunks[i].bits  = (bits - shift) / (res->chunks_len - i);
+    shift += res->chunks[i].bits;
+    if (! IdIndex_fillChunk(res, &(res->chunks[i]))){
+      IdIndex_destroy(res);
+      return NULL;
+    }
+  }
+  return res;
+}
+
+IdIndex *IdIndex_load(const char *filename, size_t size, size_t max_dist){
+  IdIndex *res;
+  FILE *handle;
+  unsigned long long *ids = NULL, *grown, id;
+  size_t ids_len = 0, ids_cap = 0;
+  int read;
+  assert(filename && strlen(filename) > 0);
+  assert(size > 0 && size <= 7);
+  
+  handle = fopen(filename, "r");
+  if (! handle) return NULL;
+  
+  while ((read = fscanf(handle, "%llu", &id)) == 1){
+    if (size*size < 64 && id >> (size*size)) break;
+    if (ids_len == ids_cap){
+      ids_cap = (ids_cap) ? 2*ids_cap : 1024;
+      grown = realloc(ids, ids_cap*sizeof(unsigned long long));
+      if (! grown) break;
+      ids = grown;
+    }
+    ids[ids_len++] = id;
+  }
+  
+  /* stopped before the end of file: not a list of IDs */
+  if (read != EOF || ferror(handle)){
+    fclose(handle);
+    free(ids);
+    return NULL;
+  }
+  fclose(handle);
+  
+  res = IdIndex_create(ids, ids_len, size, max_dist);
+  free(ids);
+  return res;
+}
+
+IdIndex_Match IdIndex_resolve(IdIndex *self, PBM *barcode,
+                              unsigned long long *id)
+{
+  IdIndex_Chunk *chunk;
+  uint64_t code, mask;
+  uint32_t i, member;
+  size_t c, width, height, found = SIZE_MAX;
+  assert(self && barcode && id);
+  
+  PBM_size(barcode, &width, &height);
+  if (width != self->size+1 || height != self->size+1)
+    return ID_INDEX_NOT_FOUND;
+  code = IdIndex_codeword(barcode, self->size);
+  
+  /* any codeword within max_dist shares a chunk with code */
+  for (c=0; c<self->chunks_len; c++){
+    chunk = &(self->chunks[c]);
+    mask  = (((uint64_t) 1) << chunk->bits) - 1;
+    i     = chunk->starts[(code >> chunk->shift) & mask];
+    for (; i<chunk->starts[((code >> chunk->shift) & mask) + 1]; i++){
+      member = chunk->members[i];
+      if (member == found ||
+          IdIndex_popcount(self->codes[member] ^ code) > self->max_dist)
+        continue;
+      if (found != SIZE_MAX) return ID_INDEX_AMBIGUOUS;
+      found = member;
+    }
+  }
+  
+  if (found == SIZE_MAX) return ID_INDEX_NOT_FOUND;
+  *id = self->ids[found];
+  return ID_INDEX_FOUND;
+}
+
+size_t IdIndex_size(IdIndex *self){
+  assert(self);
+  return self->size;
+}
+
+void IdIndex_destroy(IdIndex *self){
+  size_t i;
+  assert(self);
+  
+  for (i=0; i<self->chunks_len; i++){
+    free(self->chunks[i].starts);
+    free(self->chunks[i].members);
+  }
+  free(self->codes);
+  free(self->ids);
+  free(self);
+}
@@ -0,0 +1,76 @@
+#ifndef DEFINE_ID_INDEX_HEADER
+#define DEFINE_ID_INDEX_HEADER
+
+/*
+ ***********************************************************
+ * id_index.h - Index of known IDs by Hamming distance     *
+ * ----------                                              *
+ * Finds which known ID a damaged barcode was, when it has *
+ * too many errors for its checksum to correct them.       *
+ * Barcodes are compared as whole codewords (data and      *
+ * checksum bits), split in m chunks with one table per    *
+ * chunk. Two codewords at most k<m bits apart have at     *
+ * least one equal chunk, so only codewords sharing a      *
+ * chunk with the scanned one are compared to it.          *
+ ***********************************************************
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include "pbm.h"
+
+typedef struct IdIndex_t IdIndex;
+
+/* Results of IdIndex_resolve */
+typedef enum {
+  ID_INDEX_NOT_FOUND, /* No known ID within max_dist */
+  ID_INDEX_FOUND,     /* Exactly one known ID within max_dist */
+  ID_INDEX_AMBIGUOUS  /* Several known IDs within max_dist */
+} IdIndex_Match;
+
+/* Largest max_dist accepted by IdIndex_create */
+#define ID_INDEX_MAX_DIST 15
+
+/*
+ * Index the barcodes of ids, rendered with Barcode_renderULL(id, size)
+ * @pre : ids contains n values, each fitting in size*size bits,
+ *        0<size<=7, max_dist<=ID_INDEX_MAX_DIST
+ * @post: returns a new index, or NULL if an error occured
+ */
+IdIndex *IdIndex_create(const unsigned long long *ids, size_t n, size_t size,
+                        size_t max_dist);
+
+/*
+ * Same as IdIndex_create, with IDs read from a file (whitespace separated,
+ * as given to the barcode program)
+ * @pre : filename is a valid non-empty C string, same as IdIndex_create
+ * @post: returns a new index, or NULL if the file couldn't be read, holds
+ *        something else than IDs fitting in size*size bits, or if an
+ *        error occured
+ */
+IdIndex *IdIndex_load(const char *filename, size_t size, size_t max_dist);
+
+/*
+ * Find the known ID whose barcode differs from barcode by at most max_dist
+ * pixels
+ * @pre : self is a valid index, barcode is a valid PBM image, id is a valid
+ *        pointer
+ * @post: if the result is ID_INDEX_FOUND, *id is set to the known ID.
+ *        Barcodes of another size than the indexed ones are never found.
+ */
+IdIndex_Match IdIndex_resolve(IdIndex *self, PBM *barcode,
+                              unsigned long long *id);
+
+/*
+ * @pre : self is a valid index
+ * @post: returns the size of indexed barcodes, given to IdIndex_create
+ */
+size_t IdIndex_size(IdIndex *self);
+
+/*
+ * @pre : self is a valid index
+ * @post: memory freed for self
+ */
+void IdIndex_destroy(IdIndex *self);
+
+#endif
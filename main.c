@@ -1,8 +1,11 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <assert.h>
 #include "pbm.h"
 #include "barcode.h"
 #include "file_foreach.h"
+#include "pbm_stream.h"
 
 /*
  *************************************
@@ -11,6 +14,28 @@
  *************************************
  */
 
+/* Data size of ULg ID barcodes, and scale at which they are written */
+#define ULG_BARCODE_SIZE  6
+#define ULG_BARCODE_SCALE 10
+
+/* Modules around each barcode on a sheet (quiet zone) */
+#define SHEET_MARGIN 1
+
+/* Sheet of barcodes under construction, when running with --sheet.
+ * Sheets are streamed to their file one row of barcodes (band) at a time,
+ * so that memory doesn't depend on the number of rows. */
+typedef struct {
+  size_t cols, rows;         /* layout of the sheet, in barcodes */
+  size_t count;              /* number of barcodes already on the sheet */
+  unsigned long long first;  /* first ULg ID on the sheet, names the file */
+  PBM   *band;               /* row of barcodes being drawn */
+  FILE  *output;             /* sheet file, NULL if it couldn't be opened */
+  PBM_Writer *writer;
+} Sheet;
+
+/* NULL band if barcodes are written in separate files */
+static Sheet sheet = {0, 0, 0, 0, NULL, NULL, NULL};
+
 /*
  * Print usage on stdout
  */
@@ -20,19 +45,133 @@ static void usage(void);
  * Callback invoked on each line of the input file
  * @pre : str is a valid NULL-terminated string (possibly empty)
  * @post: if str is a valid ULg ID, its bar code is written in [ULg ID].pbm
+ *        or on the current sheet.
  *        Output an informative message on stdout for each non-empty line
  */
 static bool renderUlgId(char *str);
 
+/*
+ * Render a ULg ID already known to be below 99999999
+ * @post: its bar code is written in [ULg ID].pbm or on the current sheet.
+ *        Output an informative message on stdout
+ */
+static void renderValue(unsigned long long value);
+
+/*
+ * Render every ULg ID between first and last, without intermediate list
+ * @pre : first<=last<99999999
+ * @post: renderValue invoked on each of them, in increasing order
+ */
+static void renderRange(unsigned long long first, unsigned long long last);
+
+/*
+ * @pre : spec is a valid C string, first and last valid pointers
+ * @post: if spec looks like START-END, with START<=END<99999999, *first and 
+ *        *last are set to START and END and true is returned. 
+ *        Otherwise returns false.
+ */
+static bool parseRange(const char *spec, unsigned long long *first, 
+                       unsigned long long *last);
+
+/*
+ * @pre : spec is a valid C string, shard and shards valid pointers
+ * @post: if spec looks like K/N, with 1<=K<=N, *shard and *shards are set 
+ *        to K and N and true is returned. Otherwise returns false.
+ */
+static bool parseShard(const char *spec, unsigned long *shard, 
+                       unsigned long *shards);
+
+/*
+ * Restrict [first,last] to its part handled by shard K of N. The range is
+ * cut in N consecutive slices whose sizes differ by at most 1, so that each
+ * process could compute its own slice without any coordination.
+ * @pre : first<=last, 1<=shard<=shards
+ * @post: [first,last] is the slice of shard, or first>last if it is empty
+ */
+static void shardRange(unsigned long long *first, unsigned long long *last, 
+                       unsigned long shard, unsigned long shards);
+
+/*
+ * @pre : spec is a valid C string
+ * @post: if spec looks like COLSxROWS (both >0), sheet is set up for this
+ *        layout and true is returned. Otherwise returns false.
+ */
+static bool Sheet_setup(const char *spec);
+
+/*
+ * Draw a barcode in the next free cell of the sheet, saving it once full
+ * @pre : sheet is set up, barcode is a valid barcode image
+ * @post: barcode drawn on the sheet
+ */
+static void Sheet_add(PBM *barcode, unsigned long long value);
+
+/*
+ * Write the band in the sheet file, and clear it
+ * @pre : sheet is set up
+ * @post: band appended to the sheet file, if it could be opened
+ */
+static void Sheet_pushBand(void);
+
+/*
+ * Complete the current sheet in sheet-[first ULg ID].pbm if it isn't empty,
+ * so that the next barcode starts a new one.
+ * Output an informative message on stdout
+ */
+static void Sheet_flush(void);
+
 int main(int argc, const char **argv){
   FILE *input;
+  unsigned long long first=0, last=0;
+  unsigned long shard=1, shards=1;
+  bool with_range=false, with_shard=false;
   int i;
-  if (argc < 2){
+  
+  for (i=1; i+1<argc && strncmp("--", argv[i], 2) == 0; i+=2){
+    if (strcmp("--sheet", argv[i]) == 0){
+      if (! Sheet_setup(argv[i+1])){
+        printf("Invalid sheet layout %s (expected COLSxROWS)\n", argv[i+1]);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp("--range", argv[i]) == 0){
+      if (! parseRange(argv[i+1], &first, &last)){
+        printf("Invalid range %s (expected START-END)\n", argv[i+1]);
+        return EXIT_FAILURE;
+      }
+      with_range = true;
+    } else if (strcmp("--shard", argv[i]) == 0){
+      if (! parseShard(argv[i+1], &shard, &shards)){
+        printf("Invalid shard %s (expected K/N, 1<=K<=N)\n", argv[i+1]);
+        return EXIT_FAILURE;
+      }
+      with_shard = true;
+    } else {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+  
+  if (with_shard && ! with_range){
+    printf("--shard only applies to --range\n");
+    return EXIT_FAILURE;
+  }
+  
+  if (argc <= i && ! with_range){
     usage();
     return 0;
   }
   
-  for (i=1; i<argc; i++){
+  if (with_range){
+    shardRange(&first, &last, shard, shards);
+    if (first <= last){
+      printf("Generating range %llu-%llu (shard %lu/%lu)\n", 
+             first, last, shard, shards);
+      renderRange(first, last);
+    } else {
+      printf("Nothing to generate for shard %lu/%lu\n", shard, shards);
+    }
+  }
+  
+  for (; i<argc; i++){
     input = (strcmp("-", argv[i]) == 0) ? stdin : fopen(argv[i], "r");
     if (! input){
       printf("Couldn't open file %s !\n", argv[i]);
@@ -47,14 +186,17 @@ int main(int argc, const char **argv){
     if (input != stdin) fclose(input);
   }
   
+  if (sheet.band){
+    Sheet_flush();
+    PBM_destroy(sheet.band);
+  }
+  
   return EXIT_SUCCESS;
 }
 
 static bool renderUlgId(char *str){
   unsigned long long value;
-  char filename[13] = {'\0'}; /* ULgID (%8d) + .pbm */
   char *error;
-  PBM *barcode;
   
   if (strcmp(str, "\n") == 0)
     return true;
@@ -62,22 +204,201 @@ static bool renderUlgId(char *str){
   value = (unsigned long long) strtoll(str, &error, 10);
   if (error == str || value >= 99999999)
     printf("%s doesn't look like an ULg ID\n", str);
-  else {
+  else
+    renderValue(value);
+  
+  return true;
+}
+
+static void renderValue(unsigned long long value){
+  char filename[13] = {'\0'}; /* ULgID (%8d) + .pbm */
+  PBM *barcode;
+  
+  barcode = Barcode_renderULL(value, ULG_BARCODE_SIZE);
+  if (! barcode){
+    printf("Not enough memory to render %llu\n", value);
+    return;
+  }
+  if (sheet.band){
+    Sheet_add(barcode, value);
+    if (value < 20000000) printf("%llu: warning: not an ULg ID\n", value);
+  } else {
     sprintf(filename, "%llu.pbm", value);
-    barcode = Barcode_renderULL(value, 6);
-    PBM_saveP1(barcode, filename, 10);
-    PBM_destroy(barcode);
+    PBM_saveP1(barcode, filename, ULG_BARCODE_SCALE);
     printf("%s saved ", filename);
     if (value < 20000000) printf("(warning: not an ULg ID)");
     printf("\n");
   }
+  PBM_destroy(barcode);
+}
+
+static void renderRange(unsigned long long first, unsigned long long last){
+  unsigned long long value;
+  assert(first <= last && last < 99999999);
   
-  return true;
+  for (value=first; value<=last; value++)
+    renderValue(value);
+}
+
+static bool parseRange(const char *spec, unsigned long long *first, 
+                       unsigned long long *last)
+{
+  char *end;
+  assert(spec && first && last);
+  
+  if (*spec < '0' || *spec > '9') return false;
+  *first = strtoull(spec, &end, 10);
+  if (*end != '-') return false;
+  spec = end+1;
+  if (*spec < '0' || *spec > '9') return false;
+  *last = strtoull(spec, &end, 10);
+  if (*end != '\0') return false;
+  
+  if (*last >= 99999999){
+    printf("%llu doesn't look like an ULg ID\n", *last);
+    return false;
+  }
+  return *first <= *last;
+}
+
+static bool parseShard(const char *spec, unsigned long *shard, 
+                       unsigned long *shards)
+{
+  char *end;
+  assert(spec && shard && shards);
+  
+  if (*spec < '0' || *spec > '9') return false;
+  *shard = strtoul(spec, &end, 10);
+  if (*end != '/') return false;
+  spec = end+1;
+  if (*spec < '0' || *spec > '9') return false;
+  *shards = strtoul(spec, &end, 10);
+  if (*end != '\0') return false;
+  
+  return 1 <= *shard && *shard <= *shards;
+}
+
+static void shardRange(unsigned long long *first, unsigned long long *last, 
+                       unsigned long shard, unsigned long shards)
+{
+  unsigned long long count, base, extra, k;
+  assert(first && last);
+  assert(*first <= *last);
+  assert(1 <= shard && shard <= shards);
+  
+  /* the extra first shards get one more ID than the others */
+  count = *last - *first + 1;
+  base  = count / shards;
+  extra = count % shards;
+  k     = shard-1;
+  
+  *first += k*base + ((k < extra) ? k : extra);
+  count   = base + ((k < extra) ? 1 : 0);
+  if (count == 0){
+    /* empty shard: first > last */
+    *last = *first;
+    (*first)++;
+  } else {
+    *last = *first + count - 1;
+  }
+}
+
+static bool Sheet_setup(const char *spec){
+  unsigned long cols, rows;
+  size_t cell;
+  char *end;
+  
+  cols = strtoul(spec, &end, 10);
+  if (end == spec || *end != 'x') return false;
+  spec = end+1;
+  rows = strtoul(spec, &end, 10);
+  if (end == spec || *end != '\0') return false;
+  if (cols == 0 || rows == 0) return false;
+  
+  cell = (ULG_BARCODE_SIZE+1+2*SHEET_MARGIN) * ULG_BARCODE_SCALE;
+  sheet.cols  = cols;
+  sheet.rows  = rows;
+  sheet.count = 0;
+  sheet.band  = PBM_create(cols*cell, cell);
+  return sheet.band != NULL;
+}
+
+static void Sheet_add(PBM *barcode, unsigned long long value){
+  char filename[20] = {'\0'}; /* sheet- + ULgID (%8d) + .pbm */
+  size_t width, cell;
+  assert(sheet.band);
+  
+  PBM_size(sheet.band, &width, &cell);
+  if (sheet.count == 0){
+    sheet.first = value;
+    sprintf(filename, "sheet-%llu.pbm", value);
+    sheet.output = fopen(filename, "w");
+    sheet.writer = NULL;
+    if (sheet.output)
+      sheet.writer = PBM_Writer_begin(sheet.output, PBM_P1, 
+                                      width, cell*sheet.rows);
+  }
+  
+  PBM_blit(sheet.band, 
+           (sheet.count % sheet.cols)*cell + SHEET_MARGIN*ULG_BARCODE_SCALE,
+           SHEET_MARGIN*ULG_BARCODE_SCALE, 
+           barcode, ULG_BARCODE_SCALE);
+  
+  sheet.count++;
+  if (sheet.count % sheet.cols == 0)
+    Sheet_pushBand();
+  if (sheet.count == sheet.cols*sheet.rows)
+    Sheet_flush();
+}
+
+static void Sheet_pushBand(void){
+  size_t width, height, y;
+  assert(sheet.band);
+  
+  PBM_size(sheet.band, &width, &height);
+  if (sheet.writer)
+    for (y=0; y<height; y++)
+      PBM_Writer_pushRow(sheet.writer, sheet.band, y);
+  PBM_fill(sheet.band, 0, 0, width, height, false);
+}
+
+static void Sheet_flush(void){
+  size_t bands;
+  bool saved = false;
+  assert(sheet.band);
+  
+  if (sheet.count == 0) return;
+  
+  /* last band, then blank ones up to the expected height */
+  bands = (sheet.count + sheet.cols-1) / sheet.cols;
+  if (sheet.count % sheet.cols != 0) Sheet_pushBand();
+  for (; bands<sheet.rows; bands++) Sheet_pushBand();
+  
+  if (sheet.writer) saved = PBM_Writer_end(sheet.writer);
+  if (sheet.output && fclose(sheet.output) != 0) saved = false;
+  
+  if (saved)
+    printf("sheet-%llu.pbm saved (%u barcodes)\n", 
+           sheet.first, (unsigned int) sheet.count);
+  else
+    printf("Error when saving sheet-%llu.pbm\n", sheet.first);
+  
+  sheet.output = NULL;
+  sheet.writer = NULL;
+  sheet.count  = 0;
 }
 
 static void usage(){
-  printf("Usage: barcode FILE1 [ FILE2 [...] ] \n"
+  printf("Usage: barcode [ OPTIONS ] FILE1 [ FILE2 [...] ] \n"
          "       where FILE is a path to a file which contain one ULg ID "
          "per line\n"
-         "       if FILE is '-', reads from stdin\n");
+         "       if FILE is '-', reads from stdin\n"
+         "Options:\n"
+         "  --sheet COLSxROWS  barcodes are tiled COLS by ROWS in "
+         "sheet-[first ULg ID].pbm\n"
+         "                     files instead of one file per ULg ID\n"
+         "  --range START-END  also render every ULg ID from START to END "
+         "(FILE optional)\n"
+         "  --shard K/N        only render the K-th of N equal slices of "
+         "the range\n");
 }
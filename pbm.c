@@ -1,25 +1,37 @@
+#define _POSIX_C_SOURCE 200809L /* getc_unlocked */
 #include "pbm.h"
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
 
 /* PRIVATE HEADER */
 
-/* Pixels are internally stored by block of 8 bits, aka char */
-typedef unsigned char PixBlock;
+/* Pixels are internally stored by block of 64 bits, row after row without
+ * padding. Pixel [x,y] is bit (y*width+x)%64 of block (y*width+x)/64. */
+typedef uint64_t PixBlock;
 
 /* Numbers of bits in a PixBlock. If some day we change PixBlock size... */
 static const size_t PixBlock_bits = 8*sizeof(PixBlock);
 
-/* An image is just a WxH PixBlock data structure */
-struct PBM_t {
-  size_t     width;
-  size_t    height;
-  PixBlock *pixmap;
-};
+/* Images up to PBM_INLINE_PIXELS are stored in this number of blocks */
+#define PBM_INLINE_BLOCKS (PBM_INLINE_PIXELS/64)
+
+/* Pixmaps of struct PBM_t (see pbm.h) are arrays of PixBlock, whole ones
+ * for inline images (fails to compile else) */
+typedef char PBM_Inline_isWholeBlocks[
+  (sizeof(PixBlock) == sizeof(uint64_t) &&
+   PBM_INLINE_BLOCKS*64 == PBM_INLINE_PIXELS) ? 1 : -1];
 
 /* Standard separators, by increasing precedence */
 static const char PBM_separator[2] = {' ', '\n'};
 
+/*
+ * @pre : self is a valid PBM image
+ * @post: returns the blocks holding the pixels of self
+ */
+static inline PixBlock *PBM_pixmap(PBM *self);
+
 /*
  * Convert a [x,y] position in image to a [offset_pixmap,offset_block] position
  * @pre : self is a valid PBM image, x<self.width, y<self.height
@@ -42,9 +54,176 @@ static inline bool PixBlock_get(PixBlock self, size_t offset);
  */
 static inline void PixBlock_set(PixBlock *self, size_t offset, bool val);
 
+/*
+ * @pre : len<=PixBlock_bits
+ * @post: returns a PixBlock with its len lowest bits set
+ */
+static inline PixBlock PixBlock_mask(size_t len);
+
+/*
+ * @pre : self != 0
+ * @post: returns the offset of the lowest bit set in self
+ */
+static inline size_t PixBlock_ctz(PixBlock self);
+
+/*
+ * @post: returns the number of bits set in self
+ */
+static inline size_t PixBlock_popcount(PixBlock self);
+
+/*
+ * Reads len consecutive bits of a pixmap, starting at bit offset pos
+ * @pre : map is a valid pixmap of at least pos+len bits, len<=PixBlock_bits
+ * @post: returns those bits, first one in lowest bit, upper bits cleared
+ */
+static inline PixBlock PBM_loadBits(const PixBlock *map, size_t pos, size_t len);
+
+/*
+ * Writes the len lowest bits of val in a pixmap, starting at bit offset pos
+ * @pre : map is a valid pixmap of at least pos+len bits, len<=PixBlock_bits
+ * @post: map bits [pos,pos+len[ replaced, other bits unchanged
+ */
+static inline void PBM_storeBits(PixBlock *map, size_t pos, size_t len, 
+                                 PixBlock val);
+
+/*
+ * Copy len bits from src (starting at bit src_pos) to dst (at bit dst_pos),
+ * one block at a time.
+ * @pre : both ranges are inside their pixmaps and don't overlap
+ * @post: dst bits [dst_pos,dst_pos+len[ = src bits [src_pos,src_pos+len[
+ */
+static void PBM_copyBits(PixBlock *dst, size_t dst_pos, 
+                         const PixBlock *src, size_t src_pos, size_t len);
+
+/*
+ * @pre : map is a valid pixmap of at least pos+len bits
+ * @post: map bits [pos,pos+len[ are set to val
+ */
+static void PBM_fillBits(PixBlock *map, size_t pos, size_t len, bool val);
+
+/*
+ * Enlarge a single line of len pixels horizontally by scale: each source bit
+ * becomes a run of scale bits. Only the out_len first bits are written, so 
+ * that the result could be clipped.
+ * @pre : scale>0, out_len<=len*scale, ranges don't overlap
+ * @post: dst bits [dst_pos,dst_pos+out_len[ filled with the enlarged line
+ */
+static void PBM_scaleBits(PixBlock *dst, size_t dst_pos, 
+                          const PixBlock *src, size_t src_pos, size_t len, 
+                          size_t scale, size_t out_len);
+
+/*
+ * @pre : map is a valid pixmap of at least pos+len bits
+ * @post: returns the number of bits set in map bits [pos,pos+len[
+ */
+static size_t PBM_countBits(const PixBlock *map, size_t pos, size_t len);
+
+/* An encoded image being read, from a buffer or from a stream */
+typedef struct {
+  const unsigned char *pos, *end;  /* rest of the buffer */
+  FILE *handle;                    /* stream, or NULL for a buffer */
+} PBM_Source;
+
+/*
+ * @pre : src is a valid source
+ * @post: returns the next character of src, or EOF at its end
+ */
+static inline int PBM_Source_get(PBM_Source *src);
+
+/*
+ * @pre : src is a valid source, c was just returned by PBM_Source_get
+ * @post: c will be returned again by the next PBM_Source_get
+ */
+static inline void PBM_Source_unget(PBM_Source *src, int c);
+
+/*
+ * @post: returns true for the whitespace characters skipped by fscanf
+ */
+static inline bool PBM_isSpace(int c);
+
+/*
+ * Reads a decimal number after optional whitespace, as "%" SCNu64 would
+ * @pre : src and val are valid pointers
+ * @post: returns false if there was no number (or if it overflows)
+ */
+static bool PBM_decodeNumber(PBM_Source *src, uint64_t *val);
+
+/*
+ * Reads the magic number and size of an encoded image
+ * @pre : src, format, width and height are valid pointers
+ * @post: returns PBM_NO_ERROR and sets *format, *width and *height, or the
+ *        error. src is left at the start of the raster.
+ */
+static PBM_Error PBM_decodeHeader(PBM_Source *src, PBM_Format *format,
+                                  uint64_t *width, uint64_t *height);
+
+/*
+ * Reads a row of len pixels of a raster. Streams are read no further than
+ * the last pixel of the row.
+ * @pre : src is a valid pointer, row has room for len bits
+ * @post: row bits [0,len[ contain the pixels. Returns false if the raster
+ *        ended before, missing pixels are zeros then.
+ */
+static bool PBM_decodeRow(PBM_Source *src, PBM_Format format, 
+                          PixBlock *row, uint64_t len);
+
+/*
+ * Decoder behind PBM_decode, PBM_decodeVote and the reading functions
+ * @pre : src is a valid source, scale>0, error a valid pointer or NULL
+ *        suspicious a valid pointer or NULL (only used if vote is true)
+ * @post: if vote is false, pixels are sampled as by PBM_decode, otherwise
+ *        voted as by PBM_decodeVote. P4 images give a PBM_MAGIC_ERROR 
+ *        unless allow_p4 is true.
+ */
+static PBM *PBM_decodeImage(PBM_Source *src, size_t scale, bool allow_p4, 
+                            bool vote, PBM **suspicious, PBM_Error *error);
+
+/*
+ * @pre : self is a valid PBM image, scale>0, out has room for the header
+ *        (at most 48 bytes)
+ * @post: returns the size of the header of self enlarged by scale, written
+ *        in out if it isn't NULL. Returns 0 if self is too large.
+ */
+static size_t PBM_encodeHeader(PBM *self, PBM_Format format, size_t scale, 
+                               unsigned char *out);
+
+/*
+ * @pre : self is a valid PBM image, scale>0
+ * @post: returns the size of the encoding of a row of self enlarged by scale
+ *        (so scale rows in the output), or 0 if it doesn't fit in a size_t
+ */
+static size_t PBM_bandSize(PBM *self, PBM_Format format, size_t scale);
+
+/*
+ * Encode row y of self enlarged by scale
+ * @pre : self is a valid PBM image, y<self.height, scale>0, out has room
+ *        for PBM_bandSize(self, format, scale) bytes
+ * @post: returns the number of bytes written in out (PBM_bandSize)
+ */
+static size_t PBM_encodeBand(PBM *self, PBM_Format format, size_t scale, 
+                             size_t y, unsigned char *out);
+
+/*
+ * PBM raw rows store leftmost pixel in the most significant bit of a byte,
+ * while pixmaps store it in the least significant one.
+ * @post: returns byte with its bits in reversed order
+ */
+static inline unsigned char PBM_reverseByte(unsigned char byte);
+
 
 /* PRIVATE IMPLEMENTATION */
 
+/* Often used in decoding: sets error code in errptr to errval if error is
+ * a non-null ptr, and returns retval
+ */
+#define setErrAndReturn(retval, errptr, errval) \
+{if (errptr) *errptr=errval; return retval;}
+
+static inline PixBlock *PBM_pixmap(PBM *self){
+  assert(self);
+  return (self->is_inline) ? self->pixmap.local : self->pixmap.heap;
+}
+
 static inline void PBM_offsets(PBM *self, 
                                size_t x, 
                                size_t y, 
@@ -70,9 +249,438 @@ static inline void PixBlock_set(PixBlock *self, size_t offset, bool val){
   assert(self);
   assert(offset<PixBlock_bits);
   if (val)
-    *self |= (0x01<<offset);
+    *self |= (((PixBlock) 1)<<offset);
+  else
+    *self &= ~(((PixBlock) 1)<<offset);
+}
+
+static inline PixBlock PixBlock_mask(size_t len){
+  assert(len<=PixBlock_bits);
+  return (len<PixBlock_bits) ? (((PixBlock) 1)<<len)-1 : ~((PixBlock) 0);
+}
+
+static inline size_t PixBlock_ctz(PixBlock self){
+  assert(self != 0);
+#ifdef __GNUC__
+  return (size_t) __builtin_ctzll(self);
+#else
+  {
+    size_t res = 0;
+    while (! (self & 0x01)){
+      self >>= 1;
+      res++;
+    }
+    return res;
+  }
+#endif
+}
+
+static inline PixBlock PBM_loadBits(const PixBlock *map, size_t pos, size_t len){
+  size_t index = pos / PixBlock_bits;
+  size_t shift = pos % PixBlock_bits;
+  PixBlock res;
+  assert(map);
+  assert(len<=PixBlock_bits);
+  
+  if (len == 0) return 0;
+  res = map[index] >> shift;
+  if (shift && shift+len > PixBlock_bits)
+    res |= map[index+1] << (PixBlock_bits-shift);
+  return res & PixBlock_mask(len);
+}
+
+static inline void PBM_storeBits(PixBlock *map, size_t pos, size_t len, 
+                                 PixBlock val)
+{
+  size_t index = pos / PixBlock_bits;
+  size_t shift = pos % PixBlock_bits;
+  PixBlock mask = PixBlock_mask(len);
+  assert(map);
+  
+  if (len == 0) return;
+  val &= mask;
+  map[index] = (map[index] & ~(mask<<shift)) | (val<<shift);
+  if (shift && shift+len > PixBlock_bits){
+    mask = PixBlock_mask(shift+len-PixBlock_bits);
+    map[index+1] = (map[index+1] & ~mask) | (val>>(PixBlock_bits-shift));
+  }
+}
+
+static inline size_t PixBlock_popcount(PixBlock self){
+#ifdef __GNUC__
+  return (size_t) __builtin_popcountll(self);
+#else
+  size_t res = 0;
+  for (; self; self &= self-1) res++;
+  return res;
+#endif
+}
+
+static inline unsigned char PBM_reverseByte(unsigned char byte){
+  byte = (unsigned char) (((byte & 0xf0) >> 4) | ((byte & 0x0f) << 4));
+  byte = (unsigned char) (((byte & 0xcc) >> 2) | ((byte & 0x33) << 2));
+  byte = (unsigned char) (((byte & 0xaa) >> 1) | ((byte & 0x55) << 1));
+  return byte;
+}
+
+static void PBM_copyBits(PixBlock *dst, size_t dst_pos, 
+                         const PixBlock *src, size_t src_pos, size_t len)
+{
+  size_t chunk;
+  assert(dst && src);
+  
+  while (len > 0){
+    /* align writes on dst blocks */
+    chunk = PixBlock_bits - dst_pos%PixBlock_bits;
+    if (chunk > len) chunk = len;
+    PBM_storeBits(dst, dst_pos, chunk, PBM_loadBits(src, src_pos, chunk));
+    dst_pos += chunk;
+    src_pos += chunk;
+    len     -= chunk;
+  }
+}
+
+static void PBM_fillBits(PixBlock *map, size_t pos, size_t len, bool val){
+  size_t chunk;
+  PixBlock pattern = (val) ? ~((PixBlock) 0) : 0;
+  assert(map);
+  
+  /* partial first block */
+  chunk = PixBlock_bits - pos%PixBlock_bits;
+  if (chunk > len) chunk = len;
+  PBM_storeBits(map, pos, chunk, pattern);
+  pos += chunk;
+  len -= chunk;
+  
+  /* whole blocks */
+  while (len >= PixBlock_bits){
+    map[pos/PixBlock_bits] = pattern;
+    pos += PixBlock_bits;
+    len -= PixBlock_bits;
+  }
+  
+  /* partial last block */
+  PBM_storeBits(map, pos, len, pattern);
+}
+
+static void PBM_scaleBits(PixBlock *dst, size_t dst_pos, 
+                          const PixBlock *src, size_t src_pos, size_t len, 
+                          size_t scale, size_t out_len)
+{
+  size_t i=0, run, chunk;
+  PixBlock bits;
+  bool val;
+  assert(scale>0);
+  assert(out_len<=len*scale);
+  
+  if (scale == 1){
+    PBM_copyBits(dst, dst_pos, src, src_pos, out_len);
+    return;
+  }
+  
+  while (i<len && out_len > 0){
+    /* length of the run of identical pixels starting at i */
+    val = PBM_loadBits(src, src_pos+i, 1);
+    run = 0;
+    do {
+      chunk = len-i-run;
+      if (chunk > PixBlock_bits) chunk = PixBlock_bits;
+      bits = PBM_loadBits(src, src_pos+i+run, chunk);
+      if (val) bits = ~bits & PixBlock_mask(chunk);
+      if (bits){
+        run += PixBlock_ctz(bits);
+        break;
+      }
+      run += chunk;
+    } while (i+run < len);
+    
+    /* writing it at once */
+    chunk = run*scale;
+    if (chunk > out_len) chunk = out_len;
+    PBM_fillBits(dst, dst_pos, chunk, val);
+    dst_pos += chunk;
+    out_len -= chunk;
+    i += run;
+  }
+}
+
+static size_t PBM_countBits(const PixBlock *map, size_t pos, size_t len){
+  size_t chunk, res = 0;
+  assert(map);
+  
+  while (len > 0){
+    chunk = (len < PixBlock_bits) ? len : PixBlock_bits;
+    res += PixBlock_popcount(PBM_loadBits(map, pos, chunk));
+    pos += chunk;
+    len -= chunk;
+  }
+  return res;
+}
+
+static inline int PBM_Source_get(PBM_Source *src){
+  if (src->handle) return getc_unlocked(src->handle);
+  return (src->pos < src->end) ? *src->pos++ : EOF;
+}
+
+static inline void PBM_Source_unget(PBM_Source *src, int c){
+  if (c == EOF) return;
+  if (src->handle) ungetc(c, src->handle);
+  else src->pos--;
+}
+
+static inline bool PBM_isSpace(int c){
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || 
+         c == '\v' || c == '\f';
+}
+
+static bool PBM_decodeNumber(PBM_Source *src, uint64_t *val){
+  uint64_t res = 0;
+  bool found = false;
+  int c;
+  assert(src && val);
+  
+  while (PBM_isSpace(c = PBM_Source_get(src)));
+  for (; c >= '0' && c <= '9'; c = PBM_Source_get(src)){
+    if (res > (UINT64_MAX - (c - '0')) / 10) return false;
+    res   = res*10 + (c - '0');
+    found = true;
+  }
+  PBM_Source_unget(src, c);
+  *val = res;
+  return found;
+}
+
+static PBM_Error PBM_decodeHeader(PBM_Source *src, PBM_Format *format,
+                                  uint64_t *width, uint64_t *height)
+{
+  int c;
+  assert(src && format && width && height);
+  
+  /* magic */
+  while (PBM_isSpace(c = PBM_Source_get(src)));
+  if (c == EOF)
+    return PBM_FORMAT_ERROR;
+  if (c != 'P')
+    return PBM_MAGIC_ERROR;
+  c = PBM_Source_get(src);
+  if (c != '1' && c != '4')
+    return PBM_MAGIC_ERROR;
+  *format = (c == '1') ? PBM_P1 : PBM_P4;
+  
+  /* header */
+  if (! PBM_decodeNumber(src, width) || ! PBM_decodeNumber(src, height))
+    return PBM_FORMAT_ERROR;
+  /* raster starts after a single whitespace in P4 */
+  if (*format == PBM_P4) PBM_Source_get(src);
+  return PBM_NO_ERROR;
+}
+
+static bool PBM_decodeRow(PBM_Source *src, PBM_Format format, 
+                          PixBlock *row, uint64_t len)
+{
+  PixBlock block = 0;
+  uint64_t x = 0, i;
+  int c = 0;
+  assert(src && row);
+  
+  if (format == PBM_P4){
+    /* whole bytes, 8 pixels each, while there are some */
+    for (; x<len && (c = PBM_Source_get(src)) != EOF; x+=8){
+      block |= ((PixBlock) PBM_reverseByte((unsigned char) c)) 
+               << (x % PixBlock_bits);
+      if (x % PixBlock_bits == PixBlock_bits-8){
+        row[x / PixBlock_bits] = block;
+        block = 0;
+      }
+    }
+    if (x % PixBlock_bits != 0) row[x / PixBlock_bits] = block;
+    /* padding bits of the last byte */
+    if (x > len){
+      x = len;
+      row[x / PixBlock_bits] &= PixBlock_mask(x % PixBlock_bits);
+    }
+  } else {
+    for (; x<len; x++){
+      while (PBM_isSpace(c = PBM_Source_get(src)));
+      /* any digit but 0 is a black pixel, as read with "%1d" */
+      if (c < '0' || c > '9'){
+        PBM_Source_unget(src, c);
+        break;
+      }
+      if (c != '0') block |= ((PixBlock) 1) << (x % PixBlock_bits);
+      if (x % PixBlock_bits == PixBlock_bits-1){
+        row[x / PixBlock_bits] = block;
+        block = 0;
+      }
+    }
+    if (x % PixBlock_bits != 0) row[x / PixBlock_bits] = block;
+  }
+  
+  /* zeros for missing pixels */
+  for (i=(x+PixBlock_bits-1)/PixBlock_bits; 
+       i<(len+PixBlock_bits-1)/PixBlock_bits; i++)
+    row[i] = 0;
+  return x == len;
+}
+
+static PBM *PBM_decodeImage(PBM_Source *src, size_t scale, bool allow_p4, 
+                            bool vote, PBM **suspicious, PBM_Error *error)
+{
+  PBM_Format format;
+  uint64_t file_width=0, file_height=0, row_len;
+  size_t width=0, height=0, area = scale*scale;
+  size_t x, y, y_scale, *counts = NULL;
+  PixBlock *row = NULL;
+  PBM *img = NULL, *hints = NULL;
+  PBM_Error status;
+  assert(src);
+  assert(scale>0);
+  
+  if (suspicious) *suspicious = NULL;
+  status = PBM_decodeHeader(src, &format, &file_width, &file_height);
+  if (status == PBM_NO_ERROR && format == PBM_P4 && ! allow_p4)
+    status = PBM_MAGIC_ERROR;
+  if (status != PBM_NO_ERROR)
+    setErrAndReturn(NULL, error, status);
+  
+  /* the whole image must fit in memory, see PBM_Reader otherwise */
+  if (file_width/scale > SIZE_MAX || file_height/scale > SIZE_MAX ||
+      file_width > SIZE_MAX - PixBlock_bits)
+    setErrAndReturn(NULL, error, PBM_MEMORY_ERROR);
+  width  = (size_t) (file_width/scale);
+  height = (size_t) (file_height/scale);
+  if (width<1 || height<1)
+    setErrAndReturn(NULL, error, PBM_FORMAT_ERROR);
+  
+  /* nothing is allocated for a buffer too short for the announced raster
+   * (at least a byte per pixel in P1) */
+  row_len = (format == PBM_P4) ? file_width/8 + (file_width%8 != 0) 
+                               : file_width;
+  if (! src->handle && 
+      row_len > (uint64_t) (src->end - src->pos) / file_height)
+    setErrAndReturn(NULL, error, PBM_LENGTH_ERROR);
+  
+  /* a whole row of the file, and the counts of black pixels in modules */
+  row = malloc((file_width + PixBlock_bits-1) / PixBlock_bits * 
+               sizeof(PixBlock));
+  img = PBM_create(width, height);
+  if (vote) counts = calloc(width, sizeof(size_t));
+  if (vote && suspicious) hints = PBM_create(width, height);
+  if (! row || ! img || (vote && ! counts) || 
+      (vote && suspicious && ! hints)){
+    free(row);
+    free(counts);
+    if (img)   PBM_destroy(img);
+    if (hints) PBM_destroy(hints);
+    setErrAndReturn(NULL, error, PBM_MEMORY_ERROR);
+  }
+  
+  /* reading stops at the end of the raster, further rows stay white */
+  for (y=0; y<height && status == PBM_NO_ERROR; y++){
+    for (y_scale=0; y_scale<scale && status == PBM_NO_ERROR; y_scale++){
+      if (! PBM_decodeRow(src, format, row, file_width)) 
+        status = PBM_LENGTH_ERROR;
+      /* top-left pixels are sampled, and settle ties of votes */
+      if (y_scale == 0)
+        for (x=0; x<width; x++)
+          PBM_set(img, x, y, PBM_loadBits(row, x*scale, 1));
+      if (vote)
+        for (x=0; x<width; x++)
+          counts[x] += PBM_countBits(row, x*scale, scale);
+    }
+    for (x=0; vote && x<width; x++){
+      if (2*counts[x] != area) PBM_set(img, x, y, 2*counts[x] > area);
+      if (hints && counts[x] != 0 && counts[x] != area)
+        PBM_set(hints, x, y, true);
+      counts[x] = 0;
+    }
+  }
+  
+  free(row);
+  free(counts);
+  if (suspicious) *suspicious = hints;
+  setErrAndReturn(img, error, status);
+}
+
+static size_t PBM_encodeHeader(PBM *self, PBM_Format format, size_t scale, 
+                               unsigned char *out)
+{
+  char header[48];
+  int len;
+  assert(self);
+  assert(scale>0);
+  
+  if (self->width > SIZE_MAX/scale || self->height > SIZE_MAX/scale)
+    return 0;
+  len = sprintf(header, "%s%c%" PRIu64 "%c%" PRIu64 "%c", 
+                (format == PBM_P1) ? "P1" : "P4",
+                PBM_separator[1], 
+                (uint64_t) (self->width*scale), 
+                PBM_separator[0], 
+                (uint64_t) (self->height*scale), 
+                PBM_separator[1]);
+  if (out) memcpy(out, header, (size_t) len);
+  return (size_t) len;
+}
+
+static size_t PBM_bandSize(PBM *self, PBM_Format format, size_t scale){
+  size_t width, row_len;
+  assert(self);
+  assert(scale>0);
+  
+  if (self->width > SIZE_MAX/scale) return 0;
+  width = self->width*scale;
+  
+  /* P1: "0 " per pixel, a newline every 34 pixels and at the end of rows */
+  if (format == PBM_P4)
+    row_len = width/8 + (width%8 != 0);
+  else if (width <= (SIZE_MAX - width/34 - 1) / 2)
+    row_len = 2*width + width/34 + 1;
   else
-    *self &= (0xff^(0x01<<offset));
+    return 0;
+  
+  if (row_len > SIZE_MAX/scale) return 0;
+  return row_len*scale;
+}
+
+static size_t PBM_encodeBand(PBM *self, PBM_Format format, size_t scale, 
+                             size_t y, unsigned char *out)
+{
+  unsigned char *pos = out, val;
+  size_t x, x_scale, y_scale, row_len, line_len = 0;
+  assert(self && out);
+  assert(scale>0 && y<self->height);
+  
+  if (format == PBM_P4 && scale == 1){
+    PBM_getRow(self, y, out);
+    pos += self->width/8 + (self->width%8 != 0);
+  } else if (format == PBM_P4){
+    row_len = (self->width*scale)/8 + ((self->width*scale)%8 != 0);
+    memset(out, 0, row_len);
+    for (x=0; x<self->width*scale; x++)
+      if (PBM_get(self, x/scale, y)) out[x/8] |= 0x80 >> (x%8);
+    pos += row_len;
+  } else {
+    for (x=0; x<self->width; x++){
+      val = (PBM_get(self, x, y)) ? '1' : '0';
+      for (x_scale=0; x_scale<scale; x_scale++){
+        *pos++ = val;
+        *pos++ = PBM_separator[0];
+        line_len ++;
+        if (line_len >= 34){ 
+          *pos++ = PBM_separator[1];
+          line_len = 0;
+        }
+      }
+    }
+    *pos++ = PBM_separator[1];
+  }
+  
+  /* the other rows of the band are the same */
+  row_len = (size_t) (pos - out);
+  for (y_scale=1; y_scale<scale; y_scale++)
+    memcpy(out + y_scale*row_len, out, row_len);
+  return row_len*scale;
 }
 
 
@@ -83,19 +691,42 @@ PBM *PBM_create(size_t width, size_t height){
   size_t area_len;
   assert(width>0 && height>0);
   
+  if (height > SIZE_MAX/width) return NULL;
+  
   res = malloc(sizeof(PBM));
   if (! res) return NULL;
   
-  area_len = width*height;
-  res->pixmap = malloc(area_len*sizeof(PixBlock));
-  if (! res->pixmap){
+  res->width     = width;
+  res->height    = height;
+  res->allocated = true;
+  res->is_inline = (width*height <= PBM_INLINE_PIXELS);
+  if (res->is_inline){
+    memset(res->pixmap.local, 0, sizeof(res->pixmap.local));
+    return res;
+  }
+  
+  area_len = (width*height + PixBlock_bits-1) / PixBlock_bits;
+  res->pixmap.heap = calloc(area_len, sizeof(PixBlock));
+  if (! res->pixmap.heap){
     free(res);
     return NULL;
   }
+  return res;
+}
+  
+PBM *PBM_initInline(PBM_Inline *storage, size_t width, size_t height){
+  PBM *res;
+  assert(storage);
+  assert(width>0 && height>0);
+  
+  if (height > PBM_INLINE_PIXELS/width) return NULL;
   
-  res->width  = width;
-  res->height = height;
-  memset(res->pixmap, 0, area_len*sizeof(PixBlock));
+  res = &(storage->image);
+  res->width     = width;
+  res->height    = height;
+  res->allocated = false;
+  res->is_inline = true;
+  memset(res->pixmap.local, 0, sizeof(res->pixmap.local));
   return res;
 }
 
@@ -107,114 +738,131 @@ void PBM_size(PBM *self, size_t *width, size_t *height){
 
 void PBM_destroy(PBM *self){
   assert(self);
-  free(self->pixmap);
-  free(self);
+  if (! self->is_inline) free(self->pixmap.heap);
+  if (self->allocated) free(self);
 }
 
-void PBM_writeP1(PBM *self, FILE *output, size_t scale){
-  size_t x, x_scale, y, y_scale;
-  size_t line_len = 0;
-  bool val;
+bool PBM_writeP1(PBM *self, FILE *output, size_t scale){
+  unsigned char header[48], *band;
+  size_t len, band_len, y;
+  bool res = true;
   assert(self);
   assert(scale>0);
   assert(output);
   
-  fprintf(output, "P1%c%u%c%u%c", 
-                  PBM_separator[1], 
-                  (unsigned int) (self->width*scale), 
-                  PBM_separator[0], 
-                  (unsigned int) (self->height*scale), 
-                  PBM_separator[1]);
-  
-  for (y=0; y<self->height; y++){
-    for (y_scale=0; y_scale<scale; y_scale++){
-      for (x=0; x<self->width; x++){
-        val = PBM_get(self, x, y);
-        for (x_scale=0; x_scale<scale; x_scale++){
-          fprintf(output, "%1u%c", ((val) ? 1 : 0), PBM_separator[0]);
-          line_len ++;
-          if (line_len >= 34){ 
-            fprintf(output, "%c", PBM_separator[1]);
-            line_len = 0;
-          }
-        }
-      }
-      fprintf(output, "%c", PBM_separator[1]);
-      line_len = 0;
-    }
+  len      = PBM_encodeHeader(self, PBM_P1, scale, header);
+  band_len = PBM_bandSize(self, PBM_P1, scale);
+  band     = (len && band_len) ? malloc(band_len) : NULL;
+  if (! band) return false;
+  
+  if (fwrite(header, 1, len, output) != len) res = false;
+  for (y=0; res && y<self->height; y++){
+    PBM_encodeBand(self, PBM_P1, scale, y, band);
+    if (fwrite(band, 1, band_len, output) != band_len) res = false;
   }
+  
+  free(band);
+  return res;
 }
 
 bool PBM_saveP1(PBM *self, const char *filename, size_t scale){
   FILE *output = NULL;
+  bool res;
   assert(filename && strlen(filename) > 0);
   
   output = fopen(filename, "w");
   if (! output) return false;
   
-  PBM_writeP1(self, output, scale);
-  fclose(output);
-  return true;
+  res = PBM_writeP1(self, output, scale);
+  if (fclose(output) != 0) res = false;
+  return res;
 }
 
-/* Often used in readP1: sets error code in errptr to errval if error is
- * a non-null ptr, and returns retval
- */
-#define setErrAndReturn(retval, errptr, errval) \
-{if (errptr) *errptr=errval; return retval;}
-PBM *PBM_readP1(FILE *handle, size_t scale, PBM_Error *error){
-  char buffer[3] = {'\0'};
-  size_t width=0, height=0;
-  size_t x, y, x_scale, y_scale;
-  PBM *img = NULL;
-  int read_val;
-  assert(handle);
+size_t PBM_encodedSize(PBM *self, PBM_Format format, size_t scale){
+  size_t header_len, band_len;
+  assert(self);
   assert(scale>0);
   
-  /* magic */
-  if (fscanf(handle, "%2s", buffer) != 1)
-    setErrAndReturn(NULL, error, PBM_FORMAT_ERROR);
-  if (strcmp("P1", buffer) != 0)
-    setErrAndReturn(NULL, error, PBM_MAGIC_ERROR);
+  header_len = PBM_encodeHeader(self, format, scale, NULL);
+  band_len   = PBM_bandSize(self, format, scale);
+  if (! header_len || ! band_len || 
+      band_len > (SIZE_MAX - header_len) / self->height)
+    return 0;
+  return header_len + band_len*self->height;
+}
+
+size_t PBM_encode(PBM *self, PBM_Format format, size_t scale, void *out, 
+                  size_t cap)
+{
+  unsigned char *pos = out;
+  size_t len, y;
+  assert(self);
+  assert(scale>0);
+  assert(out || cap == 0);
   
-  /* header */
-  if (fscanf(handle, "%u %u", (unsigned int *) &width, 
-             (unsigned int *) &height) != 2)
-    setErrAndReturn(NULL, error, PBM_FORMAT_ERROR);
+  len = PBM_encodedSize(self, format, scale);
+  if (len == 0 || len > cap) return 0;
   
-  width  /= scale;
-  height /= scale;
-  if (width<1 || height<1)
-    setErrAndReturn(NULL, error, PBM_FORMAT_ERROR);
+  pos += PBM_encodeHeader(self, format, scale, pos);
+  for (y=0; y<self->height; y++)
+    pos += PBM_encodeBand(self, format, scale, y, pos);
+  return len;
+}
+
+PBM *PBM_decode(const void *buf, size_t len, size_t scale, PBM_Error *error){
+  PBM_Source src;
+  assert(buf || len == 0);
   
-  img = PBM_create(width, height);
-  if (! img)
-    setErrAndReturn(NULL, error, PBM_MEMORY_ERROR);
+  src.pos    = buf;
+  src.end    = src.pos + len;
+  src.handle = NULL;
+  return PBM_decodeImage(&src, scale, true, false, NULL, error);
+}
+
+PBM *PBM_decodeVote(const void *buf, size_t len, size_t scale, 
+                    PBM **suspicious, PBM_Error *error)
+{
+  PBM_Source src;
+  assert(buf || len == 0);
   
-  for (y=0; y<height; y++){
-    for (x=0; x<width; x++){
-      /* getting value */
-      if (fscanf(handle, "%1d", &read_val) != 1)
-        setErrAndReturn(img, error, PBM_LENGTH_ERROR);
-      /* inserting value into PBM image */
-      if (read_val) PBM_set(img, x, y, true);
-      else          PBM_set(img, x, y, false);
-      /* skipping unwanted columns */
-      for (x_scale=1; x_scale<scale; x_scale++){
-        if (fscanf(handle, "%1d", &read_val) != 1)
-          setErrAndReturn(img, error, PBM_LENGTH_ERROR);
-      }
-    }
-    /* skipping unwanted lines */
-    for (y_scale=1; y_scale<scale; y_scale++){
-      for (x=0; x<width*scale; x++){
-        if (fscanf(handle, "%1d", &read_val) != 1)
-          setErrAndReturn(img, error, PBM_LENGTH_ERROR);
-      }
-    }
-  }
+  src.pos    = buf;
+  src.end    = src.pos + len;
+  src.handle = NULL;
+  return PBM_decodeImage(&src, scale, true, true, suspicious, error);
+}
+
+PBM *PBM_readP1(FILE *handle, size_t scale, PBM_Error *error){
+  PBM_Source src;
+  PBM *img;
+  assert(handle);
+  
+  src.pos    = NULL;
+  src.end    = NULL;
+  src.handle = handle;
+  
+  /* characters are read without locking the stream each time */
+  flockfile(handle);
+  img = PBM_decodeImage(&src, scale, false, false, NULL, error);
+  funlockfile(handle);
+  return img;
+}
+
+PBM *PBM_readP1Vote(FILE *handle, size_t scale, PBM **suspicious, 
+                    PBM_Error *error)
+{
+  PBM_Source src;
+  PBM *img;
+  assert(handle);
+  
+  src.pos    = NULL;
+  src.end    = NULL;
+  src.handle = handle;
   
-  setErrAndReturn(img, error, PBM_NO_ERROR);
+  /* characters are read without locking the stream each time */
+  flockfile(handle);
+  img = PBM_decodeImage(&src, scale, false, true, suspicious, error);
+  funlockfile(handle);
+  return img;
 }
 
 PBM *PBM_openP1(const char *filename, size_t scale, PBM_Error *error){
@@ -234,18 +882,154 @@ PBM *PBM_openP1(const char *filename, size_t scale, PBM_Error *error){
   return img;
 }
 
+PBM *PBM_openP1Vote(const char *filename, size_t scale, PBM **suspicious,
+                    PBM_Error *error)
+{
+  FILE *handle = NULL;
+  PBM *img = NULL;
+  assert(filename && strlen(filename) > 0);
+  
+  if (suspicious) *suspicious = NULL;
+  handle = fopen(filename, "r");
+  if (! handle){
+    if (error) *error = PBM_FILENOTFOUND;
+    return NULL;
+  }
+  
+  img = PBM_readP1Vote(handle, scale, suspicious, error);
+  fclose(handle);
+  
+  return img;
+}
+
 bool PBM_get(PBM *self, size_t col, size_t row){
   size_t offset_map, offset_block;
   PBM_offsets(self, col, row, &offset_map, &offset_block);
-  return PixBlock_get(self->pixmap[offset_map], offset_block);
+  return PixBlock_get(PBM_pixmap(self)[offset_map], offset_block);
 }
 
 void PBM_set(PBM *self, size_t col, size_t row, bool val){
   size_t offset_map, offset_block;
   PBM_offsets(self, col, row, &offset_map, &offset_block);
-  PixBlock_set(&(self->pixmap[offset_map]), offset_block, val);
+  PixBlock_set(&(PBM_pixmap(self)[offset_map]), offset_block, val);
 }
 
 void PBM_invert(PBM *self, size_t col, size_t row){
   PBM_set(self, col, row, ! PBM_get(self, col, row));
 }
+
+unsigned long long PBM_getBits(PBM *self, size_t col, size_t row, 
+                               size_t count)
+{
+  assert(self);
+  assert(count<=PixBlock_bits);
+  assert(col+count<=self->width && row<self->height);
+  return PBM_loadBits(PBM_pixmap(self), row*self->width + col, count);
+}
+
+void PBM_fill(PBM *self, size_t x, size_t y, size_t width, size_t height, 
+              bool val)
+{
+  size_t row;
+  assert(self);
+  
+  if (x >= self->width || y >= self->height) return;
+  if (width  > self->width-x)  width  = self->width-x;
+  if (height > self->height-y) height = self->height-y;
+  
+  /* full-width rectangles are contiguous in the pixmap */
+  if (width == self->width){
+    PBM_fillBits(PBM_pixmap(self), y*self->width, height*width, val);
+    return;
+  }
+  for (row=y; row<y+height; row++)
+    PBM_fillBits(PBM_pixmap(self), row*self->width+x, width, val);
+}
+
+void PBM_blit(PBM *dst, size_t x, size_t y, PBM *src, size_t scale){
+  size_t out_width, out_height, row, src_row, rep;
+  size_t line_pos;
+  assert(dst && src);
+  assert(dst != src);
+  assert(scale>0);
+  
+  if (x >= dst->width || y >= dst->height) return;
+  out_width  = src->width*scale;
+  out_height = src->height*scale;
+  if (out_width  > dst->width-x)  out_width  = dst->width-x;
+  if (out_height > dst->height-y) out_height = dst->height-y;
+  
+  for (row=0, src_row=0; row<out_height; row+=scale, src_row++){
+    /* enlarge one source line, then duplicate it scale-1 times */
+    line_pos = (y+row)*dst->width + x;
+    PBM_scaleBits(PBM_pixmap(dst), line_pos, 
+                  PBM_pixmap(src), src_row*src->width, src->width, 
+                  scale, out_width);
+    for (rep=1; rep<scale && row+rep<out_height; rep++)
+      PBM_copyBits(PBM_pixmap(dst), line_pos + rep*dst->width, 
+                   PBM_pixmap(dst), line_pos, out_width);
+  }
+}
+
+PBM *PBM_crop(PBM *self, size_t x, size_t y, size_t width, size_t height){
+  PBM *res;
+  size_t row;
+  assert(self);
+  assert(width>0 && height>0);
+  assert(x+width <= self->width && y+height <= self->height);
+  
+  res = PBM_create(width, height);
+  if (! res) return NULL;
+  
+  for (row=0; row<height; row++)
+    PBM_copyBits(PBM_pixmap(res), row*width, 
+                 PBM_pixmap(self), (y+row)*self->width + x, width);
+  return res;
+}
+
+PBM *PBM_scale(PBM *self, size_t scale){
+  PBM *res;
+  assert(self);
+  assert(scale>0);
+  
+  res = PBM_create(self->width*scale, self->height*scale);
+  if (! res) return NULL;
+  
+  PBM_blit(res, 0, 0, self, scale);
+  return res;
+}
+
+void PBM_getRow(PBM *self, size_t row, unsigned char *bytes){
+  size_t x, chunk;
+  PixBlock bits;
+  assert(self);
+  assert(row<self->height);
+  assert(bytes);
+  
+  for (x=0; x<self->width; x+=PixBlock_bits){
+    chunk = self->width - x;
+    if (chunk > PixBlock_bits) chunk = PixBlock_bits;
+    bits = PBM_loadBits(PBM_pixmap(self), row*self->width + x, chunk);
+    for (; chunk>0; chunk -= (chunk>8) ? 8 : chunk){
+      *bytes++ = PBM_reverseByte((unsigned char) (bits & 0xff));
+      bits >>= 8;
+    }
+  }
+}
+
+void PBM_setRow(PBM *self, size_t row, const unsigned char *bytes){
+  size_t x, i, chunk;
+  PixBlock bits;
+  assert(self);
+  assert(row<self->height);
+  assert(bytes);
+  
+  for (x=0; x<self->width; x+=PixBlock_bits){
+    chunk = self->width - x;
+    if (chunk > PixBlock_bits) chunk = PixBlock_bits;
+    bits = 0;
+    for (i=0; i<chunk; i+=8)
+      bits |= ((PixBlock) PBM_reverseByte(*bytes++)) << i;
+    PBM_storeBits(PBM_pixmap(self), row*self->width + x, chunk, bits);
+  }
+}
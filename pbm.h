@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /*
  * Represents a PBM image with this coordinate system:
@@ -24,6 +25,30 @@
  */
 typedef struct PBM_t PBM;
 
+/* Largest number of pixels (width*height) of an image in a PBM_Inline */
+#define PBM_INLINE_PIXELS 128
+
+/* Layout of an image. It is only visible so that PBM_Inline could hold one:
+ * fields are private to pbm.c, use the functions below. Small images
+ * (barcodes) keep their pixels inside the structure rather than behind a
+ * pointer. */
+struct PBM_t {
+  size_t     width;
+  size_t    height;
+  bool   is_inline;  /* pixels stored in pixmap.local */
+  bool   allocated;  /* self was allocated by PBM_create */
+  union {
+    uint64_t *heap;
+    uint64_t  local[PBM_INLINE_PIXELS/64];
+  } pixmap;
+};
+
+/* Storage for a small image (such as a barcode) given to PBM_initInline,
+ * to be placed on the stack or inside another structure */
+typedef struct {
+  PBM image;
+} PBM_Inline;
+
 /* Error codes returned by load functions */
 typedef enum {
   PBM_NO_ERROR    , /* No error happened during reading */
@@ -34,6 +59,12 @@ typedef enum {
   PBM_FILENOTFOUND  /* File not found for PBM_openP1 */
 } PBM_Error;
 
+/* On-disk formats: P1 (ASCII) or P4 (raw, 8 pixels per byte) */
+typedef enum {
+  PBM_P1,
+  PBM_P4
+} PBM_Format;
+
 /*
  * @pre : width > 0, height > 0
  * @post: return a new properly initialised PBM image
@@ -41,6 +72,16 @@ typedef enum {
  */
 PBM *PBM_create(size_t width, size_t height);
 
+/*
+ * Same as PBM_create, without any allocation: the image lives in storage.
+ * PBM_destroy could be called on it, but frees nothing.
+ * @pre : storage is a valid pointer, width > 0, height > 0
+ * @post: returns a new properly initialised PBM image using storage, or NULL
+ *        if width*height > PBM_INLINE_PIXELS. It stays valid as long as
+ *        storage does.
+ */
+PBM *PBM_initInline(PBM_Inline *storage, size_t width, size_t height);
+
 /*
  * @pre : self is a valid PBM image
  * @post: *width = self.width, *height = self.height.
@@ -50,7 +91,7 @@ void PBM_size(PBM *self, size_t *width, size_t *height);
 
 /*
  * @pre : self is a valid PBM image
- * @post: memory freed for self
+ * @post: memory freed for self (if it was allocated)
  */
 void PBM_destroy(PBM *self);
 
@@ -72,12 +113,72 @@ void PBM_set(PBM *self, size_t col, size_t row, bool val);
  */
 void PBM_invert(PBM *self, size_t col, size_t row);
 
+/*
+ * @pre : self is a valid PBM image, count<=64, col+count<=self.width,
+ *        row<self.height
+ * @post: returns the count pixels of row starting at col, pixel self[col,row]
+ *        in the least significant bit. Other bits are cleared.
+ */
+unsigned long long PBM_getBits(PBM *self, size_t col, size_t row, 
+                               size_t count);
+
+/*
+ * Set all pixels of the width x height rectangle whose top-left corner is 
+ * [x,y] to val. The parts of the rectangle outside of self are ignored.
+ * @pre : self is a valid PBM image
+ * @post: self[x..x+width-1,y..y+height-1] = val
+ */
+void PBM_fill(PBM *self, size_t x, size_t y, size_t width, size_t height, 
+              bool val);
+
+/*
+ * Copy src enlarged by scale into dst, with its top-left corner at [x,y].
+ * The parts of the enlarged src outside of dst are clipped.
+ * Works on whole pixel blocks rather than pixel per pixel.
+ * @pre : dst and src are distinct valid PBM images, scale>0
+ * @post: dst[x+i,y+j] = src[i/scale,j/scale] for each such pixel in dst
+ */
+void PBM_blit(PBM *dst, size_t x, size_t y, PBM *src, size_t scale);
+
+/*
+ * @pre : self is a valid PBM image, width>0, height>0, 
+ *        x+width<=self.width, y+height<=self.height
+ * @post: returns a new image containing the width x height rectangle of self
+ *        whose top-left corner is [x,y], or NULL if an error occured
+ */
+PBM *PBM_crop(PBM *self, size_t x, size_t y, size_t width, size_t height);
+
+/*
+ * @pre : self is a valid PBM image, scale>0
+ * @post: returns a new image, which is self enlarged by scale,
+ *        or NULL if an error occured
+ */
+PBM *PBM_scale(PBM *self, size_t scale);
+
+/*
+ * Pack a row of pixels as in the P4 raster: leftmost pixel in the most 
+ * significant bit of the first byte, last byte padded with zeros.
+ * @pre : self is a valid PBM image, row<self.height, 
+ *        bytes has room for (self.width+7)/8 bytes
+ * @post: bytes contains row of self
+ */
+void PBM_getRow(PBM *self, size_t row, unsigned char *bytes);
+
+/*
+ * Counterpart of PBM_getRow
+ * @pre : self is a valid PBM image, row<self.height, 
+ *        bytes contains (self.width+7)/8 bytes in the P4 raster format
+ * @post: row of self replaced by bytes
+ */
+void PBM_setRow(PBM *self, size_t row, const unsigned char *bytes);
+
 /*
  * @pre : self is a valid PBM image, output is opened in write mode, scale>0
  * @post: self is written expanded by scale in output, 
- *        according to PBM "P1" (ASCII) format
+ *        according to PBM "P1" (ASCII) format. Returns false if an error
+ *        occured.
  */
-void PBM_writeP1(PBM *self, FILE *output, size_t scale);
+bool PBM_writeP1(PBM *self, FILE *output, size_t scale);
 
 /*
  * Reads a file in the P1 format. If an error occurs, its code is placed in 
@@ -87,17 +188,66 @@ void PBM_writeP1(PBM *self, FILE *output, size_t scale);
  * @pre : handle is an opened file, scale>0, error a valid pointer or NULL
  * @post: returns a new properly initialised PBM image, or NULL if a fatal
  *        error occurs. If a PBM_LENGTH_ERROR occurs, missing bits will be
- *        filled with zeros, and image will be returned.
+ *        filled with zeros, and image will be returned. handle is read no 
+ *        further than the last pixel, so that a next image could follow.
  */
 PBM *PBM_readP1(FILE *handle, size_t scale, PBM_Error *error);
 
+/*
+ * Same as PBM_readP1, except that every pixel of the file is taken into 
+ * account: each pixel of the image is the majority value of its scale x scale
+ * block (its top-left pixel on ties). If suspicious isn't NULL, *suspicious
+ * is set to a new image of the same size, where pixels are set for blocks
+ * which weren't uniform (or to NULL if no image is returned).
+ * @pre : same as PBM_readP1, suspicious is a valid pointer or NULL
+ * @post: same as PBM_readP1
+ */
+PBM *PBM_readP1Vote(FILE *handle, size_t scale, PBM **suspicious, 
+                    PBM_Error *error);
+
 /*
  * @pre : same as PBM_writeP1 except that we pass a file path instead of
  *        a file pointer. Filename is a valid C string, filename.length>0
- * @post: return true, or false if output file couldn't be opened
+ * @post: return true, or false if output file couldn't be opened or written
  */
 bool PBM_saveP1(PBM *self, const char *filename, size_t scale);
 
+/*
+ * Size of the encoding of self by PBM_encode, to allocate its buffer
+ * @pre : self is a valid PBM image, scale>0
+ * @post: returns the exact number of bytes of self expanded by scale in
+ *        format, or 0 if it doesn't fit in a size_t
+ */
+size_t PBM_encodedSize(PBM *self, PBM_Format format, size_t scale);
+
+/*
+ * Same as PBM_writeP1 (or PBM_Writer for P4), in a memory buffer
+ * @pre : self is a valid PBM image, scale>0, out has room for cap bytes
+ * @post: returns the number of bytes written in out, or 0 (and out is left
+ *        unchanged) if cap is lower than PBM_encodedSize(self, format, scale)
+ */
+size_t PBM_encode(PBM *self, PBM_Format format, size_t scale, void *out, 
+                  size_t cap);
+
+/*
+ * Same as PBM_readP1, from the len bytes of buf. Both P1 and P4 images are
+ * decoded, according to their magic number.
+ * @pre : buf contains len bytes, scale>0, error a valid pointer or NULL
+ * @post: same as PBM_readP1, except that NULL is returned with a 
+ *        PBM_LENGTH_ERROR if buf is too short for the raster announced by
+ *        the header (checked before anything is allocated, a P1 raster 
+ *        taking at least a byte per pixel).
+ */
+PBM *PBM_decode(const void *buf, size_t len, size_t scale, PBM_Error *error);
+
+/*
+ * Same as PBM_readP1Vote, from the len bytes of buf, as PBM_decode
+ * @pre : same as PBM_decode, suspicious is a valid pointer or NULL
+ * @post: same as PBM_readP1Vote
+ */
+PBM *PBM_decodeVote(const void *buf, size_t len, size_t scale, 
+                    PBM **suspicious, PBM_Error *error);
+
 /*
  * @pre : same as PBM_readP1 except that we pass a file path instead of
  *        a file pointer. Filename is a valid C string, filename.length>0
@@ -105,4 +255,12 @@ bool PBM_saveP1(PBM *self, const char *filename, size_t scale);
  */
 PBM *PBM_openP1(const char *filename, size_t scale, PBM_Error *error);
 
+/*
+ * @pre : same as PBM_readP1Vote except that we pass a file path instead of
+ *        a file pointer. Filename is a valid C string, filename.length>0
+ * @post: same as PBM_readP1Vote
+ */
+PBM *PBM_openP1Vote(const char *filename, size_t scale, PBM **suspicious,
+                    PBM_Error *error);
+
 #endif
@@ -0,0 +1,235 @@
+#include "pbm_stream.h"
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+
+/* PRIVATE HEADER */
+
+/* Pixels per text line in P1 output, as in PBM_writeP1 */
+static const size_t PBM_Stream_lineMax = 34;
+
+struct PBM_Writer_t {
+  FILE      *output;
+  PBM_Format format;
+  size_t     width;
+  uint64_t   height, rows;   /* expected and already written rows */
+  unsigned char *bytes;      /* packed row, (width+7)/8 bytes */
+  char      *text;           /* P1 row, NULL for P4 */
+  bool       failed;
+};
+
+struct PBM_Reader_t {
+  FILE      *input;
+  PBM_Format format;
+  uint64_t   width, height, rows; /* image size and already read rows */
+  unsigned char *bytes;      /* packed row, (width+7)/8 bytes */
+};
+
+/*
+ * @pre : width>0
+ * @post: returns the length of a row of width pixels in P1 text,
+ *        trailing newline included
+ */
+static inline size_t PBM_Stream_textLen(size_t width);
+
+/*
+ * Read a row of pixels from a P1 file
+ * @pre : self is a valid reader on a P1 file
+ * @post: self.bytes contains the row, returns false if input ended (or
+ *        held something else than digits and whitespace)
+ */
+static bool PBM_Reader_readText(PBM_Reader *self);
+
+
+/* PRIVATE IMPLEMENTATION */
+
+static inline size_t PBM_Stream_textLen(size_t width){
+  return 2*width + width/PBM_Stream_lineMax + 1;
+}
+
+static bool PBM_Reader_readText(PBM_Reader *self){
+  size_t x, bytes_len;
+  int c;
+  assert(self);
+  
+  bytes_len = (size_t) (self->width+7)/8;
+  memset(self->bytes, 0, bytes_len);
+  for (x=0; x<self->width; x++){
+    do {
+      c = getc(self->input);
+    } while (c == ' ' || c == '\n' || c == '\r' || c == '\t' || 
+             c == '\v' || c == '\f');
+    /* any digit but 0 is a black pixel, as read by PBM_readP1 */
+    if (c < '0' || c > '9'){
+      if (c != EOF) ungetc(c, self->input);
+      return false;
+    }
+    if (c != '0') self->bytes[x/8] |= (unsigned char) (0x80 >> (x%8));
+  }
+  return true;
+}
+
+
+/* PUBLIC IMPLEMENTATION */
+
+PBM_Writer *PBM_Writer_begin(FILE *output, PBM_Format format,
+                             uint64_t width, uint64_t height)
+{
+  PBM_Writer *res;
+  assert(output);
+  assert(width>0 && height>0);
+  
+  /* a row must fit in memory */
+  if (width > SIZE_MAX/2 - 1) return NULL;
+  
+  res = malloc(sizeof(PBM_Writer));
+  if (! res) return NULL;
+  
+  res->output = output;
+  res->format = format;
+  res->width  = (size_t) width;
+  res->height = height;
+  res->rows   = 0;
+  res->failed = false;
+  res->text   = NULL;
+  res->bytes  = malloc((res->width+7)/8);
+  if (format == PBM_P1)
+    res->text = malloc(PBM_Stream_textLen(res->width));
+  if (! res->bytes || (format == PBM_P1 && ! res->text)){
+    free(res->bytes);
+    free(res->text);
+    free(res);
+    return NULL;
+  }
+  
+  if (fprintf(output, "%s\n%" PRIu64 " %" PRIu64 "\n",
+              (format == PBM_P1) ? "P1" : "P4", width, height) < 0)
+    res->failed = true;
+  return res;
+}
+
+bool PBM_Writer_pushRow(PBM_Writer *self, PBM *img, size_t row){
+  size_t width, x, len=0;
+  assert(self && img);
+  assert(self->rows < self->height);
+  
+  PBM_size(img, &width, NULL);
+  assert(width == self->width);
+  
+  PBM_getRow(img, row, self->bytes);
+  self->rows++;
+  
+  if (self->format == PBM_P4){
+    if (fwrite(self->bytes, 1, (width+7)/8, self->output) != (width+7)/8)
+      self->failed = true;
+    return ! self->failed;
+  }
+  
+  for (x=0; x<width; x++){
+    self->text[len++] = (self->bytes[x/8] & (0x80 >> (x%8))) ? '1' : '0';
+    self->text[len++] = ' ';
+    if ((x+1)%PBM_Stream_lineMax == 0) self->text[len++] = '\n';
+  }
+  self->text[len++] = '\n';
+  if (fwrite(self->text, 1, len, self->output) != len)
+    self->failed = true;
+  return ! self->failed;
+}
+
+bool PBM_Writer_end(PBM_Writer *self){
+  bool res;
+  assert(self);
+  
+  res = ! self->failed && self->rows == self->height;
+  if (fflush(self->output) != 0) res = false;
+  
+  free(self->bytes);
+  free(self->text);
+  free(self);
+  return res;
+}
+
+/* Sets error code in errptr to errval if errptr is non-null, and returns
+ * retval, as in pbm.c
+ */
+#define setErrAndReturn(retval, errptr, errval) \
+{if (errptr) *errptr=errval; return retval;}
+PBM_Reader *PBM_Reader_begin(FILE *input, PBM_Error *error){
+  char buffer[3] = {'\0'};
+  uint64_t width, height;
+  PBM_Format format;
+  PBM_Reader *res;
+  assert(input);
+  
+  /* magic */
+  if (fscanf(input, "%2s", buffer) != 1)
+    setErrAndReturn(NULL, error, PBM_FORMAT_ERROR);
+  if (strcmp("P1", buffer) == 0)      format = PBM_P1;
+  else if (strcmp("P4", buffer) == 0) format = PBM_P4;
+  else setErrAndReturn(NULL, error, PBM_MAGIC_ERROR);
+  
+  /* header */
+  if (fscanf(input, "%" SCNu64 " %" SCNu64, &width, &height) != 2)
+    setErrAndReturn(NULL, error, PBM_FORMAT_ERROR);
+  if (width<1 || height<1)
+    setErrAndReturn(NULL, error, PBM_FORMAT_ERROR);
+  /* raster starts after a single whitespace in P4 */
+  if (format == PBM_P4 && getc(input) == EOF)
+    setErrAndReturn(NULL, error, PBM_LENGTH_ERROR);
+  
+  if (width > SIZE_MAX - 7)
+    setErrAndReturn(NULL, error, PBM_MEMORY_ERROR);
+  res = malloc(sizeof(PBM_Reader));
+  if (! res)
+    setErrAndReturn(NULL, error, PBM_MEMORY_ERROR);
+  res->bytes = malloc((size_t) (width+7)/8);
+  if (! res->bytes){
+    free(res);
+    setErrAndReturn(NULL, error, PBM_MEMORY_ERROR);
+  }
+  
+  res->input  = input;
+  res->format = format;
+  res->width  = width;
+  res->height = height;
+  res->rows   = 0;
+  setErrAndReturn(res, error, PBM_NO_ERROR);
+}
+
+void PBM_Reader_info(PBM_Reader *self, uint64_t *width, uint64_t *height,
+                     PBM_Format *format)
+{
+  assert(self);
+  if (width)  *width  = self->width;
+  if (height) *height = self->height;
+  if (format) *format = self->format;
+}
+
+PBM_Error PBM_Reader_pullRow(PBM_Reader *self, PBM *img, size_t row){
+  size_t width, bytes_len, read_len;
+  bool complete;
+  assert(self && img);
+  assert(self->rows < self->height);
+  
+  PBM_size(img, &width, NULL);
+  assert(width == self->width);
+  
+  bytes_len = (width+7)/8;
+  if (self->format == PBM_P4){
+    read_len = fread(self->bytes, 1, bytes_len, self->input);
+    memset(&(self->bytes[read_len]), 0, bytes_len-read_len);
+    complete = (read_len == bytes_len);
+  } else {
+    complete = PBM_Reader_readText(self);
+  }
+  
+  PBM_setRow(img, row, self->bytes);
+  self->rows++;
+  return (complete) ? PBM_NO_ERROR : PBM_LENGTH_ERROR;
+}
+
+void PBM_Reader_end(PBM_Reader *self){
+  assert(self);
+  free(self->bytes);
+  free(self);
+}
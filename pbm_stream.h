@@ -0,0 +1,82 @@
+#ifndef DEFINE_PBMSTREAM_HEADER
+#define DEFINE_PBMSTREAM_HEADER
+
+/*
+ ********************************************************
+ * pbm_stream.h - Row by row PBM reading and writing    *
+ * ------------                                         *
+ * For images too large to be held in memory at once:  *
+ * rows go through a PBM image used as a window, so     *
+ * memory only depends on the width of the image.       *
+ ********************************************************
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "pbm.h"
+
+/* A PBM file being written */
+typedef struct PBM_Writer_t PBM_Writer;
+
+/* A PBM file being read */
+typedef struct PBM_Reader_t PBM_Reader;
+
+/*
+ * Write the header of a width x height image in output
+ * @pre : output is opened in write mode, width>0, height>0
+ * @post: returns a new writer expecting height rows of width pixels,
+ *        or NULL if an error occured
+ */
+PBM_Writer *PBM_Writer_begin(FILE *output, PBM_Format format,
+                             uint64_t width, uint64_t height);
+
+/*
+ * Append a row to the image
+ * @pre : self is a valid writer, less than height rows were pushed,
+ *        img is a valid PBM image as wide as the written image,
+ *        row<img.height
+ * @post: img[*,row] is written in output. Returns false on write error
+ */
+bool PBM_Writer_pushRow(PBM_Writer *self, PBM *img, size_t row);
+
+/*
+ * @pre : self is a valid writer
+ * @post: memory freed for self (output is not closed). Returns false if
+ *        less than height rows were pushed or if a write error occured
+ */
+bool PBM_Writer_end(PBM_Writer *self);
+
+/*
+ * Read the header of a P1 or P4 image from input. If an error occurs, its
+ * code is placed in error (optional), see PBM_Error.
+ * @pre : input is opened in read mode, error a valid pointer or NULL
+ * @post: returns a new reader positionned on the first row,
+ *        or NULL if an error occured
+ */
+PBM_Reader *PBM_Reader_begin(FILE *input, PBM_Error *error);
+
+/*
+ * @pre : self is a valid reader
+ * @post: *width and *height are the size of the image being read,
+ *        *format its format. width, height or format could be NULL
+ */
+void PBM_Reader_info(PBM_Reader *self, uint64_t *width, uint64_t *height,
+                     PBM_Format *format);
+
+/*
+ * Read the next row of the image
+ * @pre : self is a valid reader, less than height rows were pulled,
+ *        img is a valid PBM image as wide as the read image, row<img.height
+ * @post: img[*,row] is replaced by the next row. Returns PBM_NO_ERROR,
+ *        or PBM_LENGTH_ERROR if input ended (missing pixels are zeros)
+ */
+PBM_Error PBM_Reader_pullRow(PBM_Reader *self, PBM *img, size_t row);
+
+/*
+ * @pre : self is a valid reader
+ * @post: memory freed for self (input is not closed)
+ */
+void PBM_Reader_end(PBM_Reader *self);
+
+#endif
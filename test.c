@@ -1,9 +1,510 @@
 #include <stdio.h>
+#include <string.h>
 #include "pbm.h"
+#include "pbm_tty.h"
+#include "pbm_stream.h"
 #include "barcode.h"
+#include "id_index.h"
 
 void gentleTest(bool expectation, const char *msg);
 
+/*
+ * Check PBM_fill, PBM_blit, PBM_crop and PBM_scale against PBM_get, on
+ * odd sizes crossing pixel blocks, with offsets and clipping
+ */
+void blitTest(void);
+
+/*
+ * Check PBM_getRow/PBM_setRow, and P1 and P4 round trips through PBM_Writer
+ * and PBM_Reader, with widths which aren't multiples of 8 or 64
+ */
+void streamTest(void);
+
+/* Scanned testcases, checked by both validation functions */
+static const char *testcases[] = {
+  "testcases/20111001.pbm",         "testcases/20111001_err_bit.pbm",
+  "testcases/20111001_err_col.pbm", "testcases/20111001_err_row.pbm",
+  "testcases/20111001_err_data.pbm", "testcases/20111001_2err.pbm"
+};
+#define TESTCASES_LEN (sizeof(testcases)/sizeof(testcases[0]))
+
+/*
+ * Compare Barcode_validateBatch with Barcode_validateChecksum on testcases 
+ * and on every 1 and 2 bits inversions of barcodes of each size
+ */
+void batchTest(void);
+
+/*
+ * Check images stored inline (PBM_initInline, small PBM_create) against
+ * images stored out of line
+ */
+void inlineTest(void);
+
+/*
+ * Compare IdIndex_resolve with an exhaustive search on damaged barcodes
+ */
+void knownTest(void);
+
+/*
+ * Check majority vote reading and validation with hints
+ */
+void hintsTest(void);
+
+/*
+ * Check PBM_encode and PBM_decode round trips, and exact encoded sizes
+ */
+void encodeTest(void);
+
+void gentleTest(bool expectation, const char *msg){
+  if (! expectation) printf("%s foireux !\n", msg);
+}
+
+static bool samePixels(PBM *a, PBM *b){
+  size_t width, height, x, y;
+  PBM_size(a, &width, &height);
+  for (y=0; y<height; y++)
+    for (x=0; x<width; x++)
+      if (PBM_get(a, x, y) != PBM_get(b, x, y)) return false;
+  return true;
+}
+
+/* Pseudo-random pixel of pattern seed */
+static bool patternPixel(size_t x, size_t y, size_t seed){
+  unsigned long long h = (x*0x9e3779b97f4a7c15ULL) ^ (y*0xc2b2ae3d27d4eb4fULL)
+                         ^ (seed*0x165667b19e3779f9ULL);
+  h ^= h >> 29;
+  return (h*0xbf58476d1ce4e5b9ULL) >> 63;
+}
+
+static PBM *patternImage(size_t width, size_t height, size_t seed){
+  PBM *res = PBM_create(width, height);
+  size_t x, y;
+  for (y=0; y<height; y++)
+    for (x=0; x<width; x++)
+      PBM_set(res, x, y, patternPixel(x, y, seed));
+  return res;
+}
+
+void blitTest(void){
+  static const size_t offsets[][3] = {
+    {0, 0, 1}, {5, 3, 1}, {63, 1, 1}, {100, 37, 1}, {0, 0, 3}, {61, 2, 2}, 
+    {120, 30, 3}, {131, 40, 2}
+  };
+  PBM *dst, *src, *res;
+  size_t i, x, y, ox, oy, scale;
+  bool expected;
+  
+  /* rectangles crossing blocks, and clipped at the right and bottom edges */
+  for (i=0; i<sizeof(offsets)/sizeof(offsets[0]); i++){
+    ox = offsets[i][0];
+    oy = offsets[i][1];
+    dst = patternImage(131, 41, 1);
+    PBM_fill(dst, ox, oy, 67*offsets[i][2], 5, (i%2 == 0));
+    for (y=0; y<41; y++)
+      for (x=0; x<131; x++){
+        expected = (x>=ox && x<ox+67*offsets[i][2] && y>=oy && y<oy+5) ?
+                   (i%2 == 0) : patternPixel(x, y, 1);
+        gentleTest(PBM_get(dst, x, y) == expected, "Test de PBM_fill");
+      }
+    PBM_destroy(dst);
+  }
+  
+  src = patternImage(67, 5, 2);
+  for (i=0; i<sizeof(offsets)/sizeof(offsets[0]); i++){
+    ox    = offsets[i][0];
+    oy    = offsets[i][1];
+    scale = offsets[i][2];
+    dst = patternImage(131, 41, 1);
+    PBM_blit(dst, ox, oy, src, scale);
+    for (y=0; y<41; y++)
+      for (x=0; x<131; x++){
+        expected = (x>=ox && x<ox+67*scale && y>=oy && y<oy+5*scale) ?
+                   patternPixel((x-ox)/scale, (y-oy)/scale, 2) : 
+                   patternPixel(x, y, 1);
+        gentleTest(PBM_get(dst, x, y) == expected, "Test de PBM_blit");
+      }
+    PBM_destroy(dst);
+  }
+  
+  dst = patternImage(131, 41, 1);
+  res = PBM_crop(dst, 61, 2, 67, 37);
+  gentleTest(res != NULL, "Test de PBM_crop");
+  for (y=0; res && y<37; y++)
+    for (x=0; x<67; x++)
+      gentleTest(PBM_get(res, x, y) == patternPixel(x+61, y+2, 1), 
+                 "Test de PBM_crop");
+  if (res) PBM_destroy(res);
+  PBM_destroy(dst);
+  
+  for (scale=1; scale<=5; scale+=2){
+    res = PBM_scale(src, scale);
+    gentleTest(res != NULL, "Test de PBM_scale");
+    for (y=0; res && y<5*scale; y++)
+      for (x=0; x<67*scale; x++)
+        gentleTest(PBM_get(res, x, y) == patternPixel(x/scale, y/scale, 2), 
+                   "Test de PBM_scale");
+    if (res) PBM_destroy(res);
+  }
+  PBM_destroy(src);
+}
+
+void streamTest(void){
+  static const PBM_Format formats[] = {PBM_P1, PBM_P4};
+  static const size_t widths[] = {5, 13, 67, 131};
+  unsigned char bytes[17], file[2048];
+  PBM *img, *copy;
+  PBM_Writer *writer;
+  PBM_Reader *reader;
+  PBM_Format format;
+  PBM_Error error;
+  FILE *handle, *truncated;
+  uint64_t width, height;
+  size_t f, w, x, y, len;
+  bool same;
+  
+  for (w=0; w<sizeof(widths)/sizeof(widths[0]); w++){
+    img  = patternImage(widths[w], 4, 3);
+    copy = PBM_create(widths[w], 4);
+    
+    /* P4 raster rows: leftmost pixel in the most significant bit */
+    for (y=0; y<4; y++){
+      memset(bytes, 0xff, sizeof(bytes));
+      PBM_getRow(img, y, bytes);
+      same = widths[w]%8 == 0 || 
+             (bytes[widths[w]/8] & (0xff >> widths[w]%8)) == 0;
+      for (x=0; x<widths[w]; x++)
+        same = same && ((bytes[x/8] >> (7-x%8)) & 1) == PBM_get(img, x, y);
+      PBM_setRow(copy, y, bytes);
+      gentleTest(same, "Test de PBM_getRow");
+    }
+    gentleTest(samePixels(img, copy), "Test de PBM_setRow");
+    
+    for (f=0; f<2; f++){
+      handle = tmpfile();
+      writer = PBM_Writer_begin(handle, formats[f], widths[w], 4);
+      for (y=0; y<4; y++)
+        PBM_Writer_pushRow(writer, img, y);
+      gentleTest(PBM_Writer_end(writer), "Test d'ecriture par lignes");
+      
+      rewind(handle);
+      PBM_fill(copy, 0, 0, widths[w], 4, false);
+      reader = PBM_Reader_begin(handle, &error);
+      gentleTest(reader != NULL, "Test de lecture par lignes");
+      if (! reader){
+        fclose(handle);
+        continue;
+      }
+      PBM_Reader_info(reader, &width, &height, &format);
+      gentleTest(width == widths[w] && height == 4 && format == formats[f],
+                 "Test d'en-tete lu par lignes");
+      for (y=0; y<4; y++)
+        gentleTest(PBM_Reader_pullRow(reader, copy, y) == PBM_NO_ERROR,
+                   "Test de lecture par lignes");
+      PBM_Reader_end(reader);
+      gentleTest(samePixels(img, copy), "Test d'aller-retour par lignes");
+      
+      /* last pixel missing (P1 ends with "0 \n", or "0 \n\n") */
+      rewind(handle);
+      len = fread(file, 1, sizeof(file), handle);
+      fclose(handle);
+      truncated = tmpfile();
+      fwrite(file, 1, len - ((formats[f] == PBM_P1) ? 4 : 1), truncated);
+      rewind(truncated);
+      reader = PBM_Reader_begin(truncated, &error);
+      for (y=0; reader && y<3; y++)
+        PBM_Reader_pullRow(reader, copy, y);
+      gentleTest(reader && 
+                 PBM_Reader_pullRow(reader, copy, 3) == PBM_LENGTH_ERROR,
+                 "Test de derniere ligne tronquee");
+      if (reader) PBM_Reader_end(reader);
+      fclose(truncated);
+    }
+    PBM_destroy(img);
+    PBM_destroy(copy);
+  }
+  
+  /* any digit but 0 is black, for both P1 readers */
+  handle = tmpfile();
+  fputs("P1\n3 2\n0 2 9\n1 0 5\n", handle);
+  rewind(handle);
+  img = PBM_readP1(handle, 1, &error);
+  rewind(handle);
+  reader = PBM_Reader_begin(handle, &error);
+  copy   = PBM_create(3, 2);
+  gentleTest(img && reader && 
+             PBM_Reader_pullRow(reader, copy, 0) == PBM_NO_ERROR &&
+             PBM_Reader_pullRow(reader, copy, 1) == PBM_NO_ERROR &&
+             samePixels(img, copy) && PBM_get(copy, 1, 0) && 
+             ! PBM_get(copy, 1, 1), "Test de chiffres autres que 0 et 1");
+  if (img)    PBM_destroy(img);
+  if (reader) PBM_Reader_end(reader);
+  PBM_destroy(copy);
+  fclose(handle);
+}
+
+void batchTest(void){
+  PBM *scalar[256], *batch[256];
+  int expected[256], results[256];
+  size_t i, n, size, bit1, bit2, area;
+  
+  for (n=0; n<TESTCASES_LEN; n++){
+    scalar[n] = PBM_openP1(testcases[n], 10, NULL);
+    batch[n]  = PBM_openP1(testcases[n], 10, NULL);
+    expected[n] = Barcode_validateChecksum(scalar[n]);
+  }
+  Barcode_validateBatch(batch, n, results);
+  for (i=0; i<n; i++){
+    gentleTest(results[i] == expected[i] && samePixels(scalar[i], batch[i]),
+               testcases[i]);
+    PBM_destroy(scalar[i]);
+    PBM_destroy(batch[i]);
+  }
+  
+  for (size=1; size<=8; size++){
+    area = (size+1)*(size+1);
+    for (bit1=0; bit1<area; bit1++){
+      n = 0;
+      for (bit2=bit1; bit2<area; bit2++){
+        scalar[n] = Barcode_renderULL(0x5a5a5a5a5a5a5a5aULL % (1ULL<<(size*size-1)), size);
+        batch[n]  = Barcode_renderULL(0x5a5a5a5a5a5a5a5aULL % (1ULL<<(size*size-1)), size);
+        PBM_invert(scalar[n], bit1%(size+1), bit1/(size+1));
+        PBM_invert(batch[n],  bit1%(size+1), bit1/(size+1));
+        if (bit2 != bit1){
+          PBM_invert(scalar[n], bit2%(size+1), bit2/(size+1));
+          PBM_invert(batch[n],  bit2%(size+1), bit2/(size+1));
+        }
+        expected[n] = Barcode_validateChecksum(scalar[n]);
+        n++;
+      }
+      Barcode_validateBatch(batch, n, results);
+      for (i=0; i<n; i++){
+        gentleTest(results[i] == expected[i] && samePixels(scalar[i], batch[i]),
+                   "Test de validation par lots");
+        PBM_destroy(scalar[i]);
+        PBM_destroy(batch[i]);
+      }
+    }
+  }
+}
+
+void inlineTest(void){
+  PBM_Inline storage;
+  PBM *stacked, *rendered, *large;
+  size_t x, y;
+  
+  gentleTest(PBM_initInline(&storage, 12, 12) == NULL, 
+             "Test d'image trop grande");
+  stacked  = PBM_initInline(&storage, 9, 9);
+  rendered = Barcode_renderULL(20111001, 8);
+  large    = PBM_create(90, 90);
+  gentleTest(stacked && rendered && large, "Test de creation en ligne");
+  
+  for (y=0; y<9; y++)
+    for (x=0; x<9; x++)
+      PBM_set(stacked, x, y, PBM_get(rendered, x, y));
+  PBM_blit(large, 0, 0, stacked, 10);
+  for (y=0; y<90; y++)
+    for (x=0; x<90; x++)
+      gentleTest(PBM_get(large, x, y) == PBM_get(rendered, x/10, y/10), 
+                 "Test d'agrandissement d'image en ligne");
+  gentleTest(Barcode_validateChecksum(stacked) == 0, 
+             "Test de validation d'image en ligne");
+  
+  PBM_destroy(stacked);
+  PBM_destroy(rendered);
+  PBM_destroy(large);
+}
+
+static size_t pixelsDistance(PBM *a, PBM *b){
+  size_t width, height, x, y, res = 0;
+  PBM_size(a, &width, &height);
+  for (y=0; y<height; y++)
+    for (x=0; x<width; x++)
+      res += (PBM_get(a, x, y) != PBM_get(b, x, y));
+  return res;
+}
+
+void knownTest(void){
+  unsigned long long ids[300], id, seed = 20111001;
+  PBM *rendered[300], *scan;
+  IdIndex *index;
+  IdIndex_Match match;
+  size_t i, j, flips, max_dist, matches, found = 0;
+  
+  /* random IDs, and some only a few pixels away from another one */
+  for (i=0; i<300; i++){
+    seed = seed*6364136223846793005ULL + 1442695040888963407ULL;
+    ids[i] = (i%3 == 2) ? ids[i-1] ^ (1ULL << (seed>>58)%36) 
+                        : (seed>>28) & 0xfffffffffULL;
+    rendered[i] = Barcode_renderULL(ids[i], 6);
+  }
+  
+  for (max_dist=0; max_dist<=6; max_dist+=2){
+    index = IdIndex_create(ids, 300, 6, max_dist);
+    gentleTest(index != NULL, "Test de creation d'index");
+    for (i=0; i<300; i++){
+      scan = Barcode_renderULL(ids[i], 6);
+      for (flips=0; flips<=max_dist+1; flips++){
+        seed = seed*6364136223846793005ULL + 1442695040888963407ULL;
+        PBM_invert(scan, (seed>>40)%7, (seed>>50)%7);
+        
+        matches = 0;
+        for (j=0; j<300; j++)
+          if (pixelsDistance(scan, rendered[j]) <= max_dist &&
+              (matches == 0 || ids[j] != ids[found])){
+            matches++;
+            found = j;
+          }
+        match = IdIndex_resolve(index, scan, &id);
+        gentleTest((matches == 0 && match == ID_INDEX_NOT_FOUND) ||
+                   (matches == 1 && match == ID_INDEX_FOUND && 
+                    id == ids[found]) ||
+                   (matches > 1 && match == ID_INDEX_AMBIGUOUS),
+                   "Test de recherche d'ID connu");
+      }
+      PBM_destroy(scan);
+    }
+    IdIndex_destroy(index);
+  }
+  
+  for (i=0; i<300; i++)
+    PBM_destroy(rendered[i]);
+}
+
+void hintsTest(void){
+  PBM *sampled, *voted, *hints, *expected, *barcode;
+  PBM_Error error;
+  size_t i, x;
+  
+  for (i=0; i<TESTCASES_LEN; i++){
+    sampled = PBM_openP1(testcases[i], 10, NULL);
+    voted   = PBM_openP1Vote(testcases[i], 10, &hints, &error);
+    gentleTest(error == PBM_NO_ERROR && samePixels(sampled, voted), 
+               "Test de lecture par vote");
+    PBM_destroy(sampled);
+    PBM_destroy(voted);
+    PBM_destroy(hints);
+  }
+  
+  /* two errors among hinted pixels are found back */
+  expected = Barcode_renderULL(20111001, 6);
+  barcode  = Barcode_renderULL(20111001, 6);
+  hints    = PBM_create(7, 7);
+  PBM_invert(barcode, 1, 2);
+  PBM_invert(barcode, 4, 5);
+  PBM_set(hints, 1, 2, true);
+  PBM_set(hints, 4, 5, true);
+  PBM_set(hints, 0, 0, true);
+  PBM_set(hints, 2, 1, true);
+  PBM_set(hints, 3, 3, true);
+  PBM_set(hints, 5, 4, true);
+  gentleTest(Barcode_validateWithHints(barcode, hints) == 1 &&
+             samePixels(barcode, expected), "Test de correction par indices");
+  
+  /* a single error is corrected as without hints, even when inverting
+   * hinted pixels gives another valid barcode */
+  PBM_destroy(barcode);
+  PBM_destroy(hints);
+  barcode = Barcode_renderULL(20111001, 6);
+  hints   = PBM_create(7, 7);
+  PBM_invert(barcode, 1, 1);
+  PBM_set(hints, 1, 4, true);
+  PBM_set(hints, 4, 1, true);
+  PBM_set(hints, 4, 4, true);
+  gentleTest(Barcode_validateWithHints(barcode, hints) == 1 &&
+             samePixels(barcode, expected), 
+             "Test de correction simple avec indices");
+  
+  /* too many hints: single error correction only */
+  PBM_invert(barcode, 1, 2);
+  PBM_invert(barcode, 4, 5);
+  for (x=0; x<BARCODE_MAX_HINTS; x++)
+    PBM_set(hints, x%7, 6-x/7, true);
+  gentleTest(Barcode_validateWithHints(barcode, hints) == -1, 
+             "Test de trop nombreux indices");
+  
+  PBM_destroy(expected);
+  PBM_destroy(barcode);
+  PBM_destroy(hints);
+}
+
+void encodeTest(void){
+  static const PBM_Format formats[] = {PBM_P1, PBM_P4};
+  unsigned char *buf;
+  PBM *rendered, *decoded;
+  PBM_Error error;
+  FILE *handle;
+  size_t f, size, scale, len;
+  
+  for (f=0; f<2; f++){
+    for (size=1; size<=8; size++){
+      rendered = Barcode_renderULL(20111001ULL % (1ULL<<(size*size-1)), size);
+      for (scale=1; scale<=11; scale+=5){
+        len = PBM_encodedSize(rendered, formats[f], scale);
+        buf = malloc(len);
+        gentleTest(len > 0 && buf && 
+                   PBM_encode(rendered, formats[f], scale, buf, len-1) == 0 &&
+                   PBM_encode(rendered, formats[f], scale, buf, len) == len,
+                   "Test de taille d'encodage");
+        decoded = PBM_decode(buf, len, scale, &error);
+        gentleTest(decoded && error == PBM_NO_ERROR && 
+                   samePixels(rendered, decoded), "Test d'encodage");
+        if (decoded) PBM_destroy(decoded);
+        
+        /* last pixel missing (P1 ends with "0 \n", or "0 \n\n"): a P4
+         * raster can't fit anymore, a P1 one could still */
+        decoded = PBM_decode(buf, len - ((formats[f] == PBM_P1) ? 4 : 1), 
+                             scale, &error);
+        gentleTest(error == PBM_LENGTH_ERROR && 
+                   (decoded != NULL) == (formats[f] == PBM_P1), 
+                   "Test de decodage tronque");
+        if (decoded) PBM_destroy(decoded);
+        free(buf);
+      }
+      PBM_destroy(rendered);
+    }
+  }
+  
+  gentleTest(PBM_decode("P2 1 1\n0\n", 10, 1, &error) == NULL && 
+             error == PBM_MAGIC_ERROR, "Test de decodage P2");
+  
+  /* huge headers alone are rejected before allocating the image */
+  gentleTest(PBM_decode("P4 40000 40000\n", 15, 1, &error) == NULL && 
+             error == PBM_LENGTH_ERROR, "Test de decodage d'en-tete P4 seul");
+  gentleTest(PBM_decode("P1 40000 40000\n0 1", 18, 1, &error) == NULL && 
+             error == PBM_LENGTH_ERROR, "Test de decodage d'en-tete P1 seul");
+  
+  /* streams are read up to the end of each image */
+  handle   = tmpfile();
+  rendered = Barcode_renderULL(20111001, 6);
+  PBM_writeP1(rendered, handle, 3);
+  PBM_writeP1(rendered, handle, 3);
+  rewind(handle);
+  for (f=0; f<2; f++){
+    decoded = PBM_readP1(handle, 3, &error);
+    gentleTest(decoded && error == PBM_NO_ERROR && 
+               samePixels(rendered, decoded), 
+               "Test de lecture d'images a la suite");
+    if (decoded) PBM_destroy(decoded);
+  }
+  PBM_destroy(rendered);
+  fclose(handle);
+  
+  /* a truncated stream is read no further than its end (and quickly, rather
+   * than a whole 400000 x 400000 raster of missing pixels) */
+  handle = tmpfile();
+  fputs("P1 400000 400000\n0 1\n", handle);
+  rewind(handle);
+  decoded = PBM_readP1Vote(handle, 20000, &rendered, &error);
+  gentleTest(decoded && rendered && error == PBM_LENGTH_ERROR && 
+             ! PBM_get(decoded, 0, 0) && PBM_get(rendered, 0, 0) && 
+             ! PBM_get(rendered, 1, 0) && ! PBM_get(rendered, 0, 1), 
+             "Test de lecture de flux tronque");
+  if (decoded)  PBM_destroy(decoded);
+  if (rendered) PBM_destroy(rendered);
+  fclose(handle);
+}
+
 int main(int argc, const char **argv){
   PBM *barcode = Barcode_renderULL(20111001, 6);
   
@@ -19,5 +520,13 @@ int main(int argc, const char **argv){
   PBM_writeTTY(barcode, stdout);
   
   PBM_destroy(barcode);
+  
+  blitTest();
+  streamTest();
+  batchTest();
+  inlineTest();
+  knownTest();
+  hintsTest();
+  encodeTest();
   return 0;
 }